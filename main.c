@@ -7,26 +7,97 @@
 #include <unsistd.h>
 #endif
 
+#ifdef WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
+#if defined ( ALLOC_STATS ) && defined ( __GLIBC__ )
+#include <execinfo.h>
+#elif defined ( WIN32 ) && defined ( _DEBUG )
+#include <crtdbg.h>
+#endif
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 #include <libswresample/swresample.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/avstring.h>
+#include <libavutil/imgutils.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_thread.h>
 
 #define SDL_AUDIO_BUFFER_SIZE (1024)
+#define DEFAULT_AUDIO_RING_MS 250
 #define MAX_AUDIO_FRAME_SIZE 192000
-#define MAX_AUDIO_QUEUE_SIZE (5 * 16 * 1024)
-#define MAX_VIDEO_QUEUE_SIZE (5 * 256 * 1024)
+#define MAX_AUDIO_QUEUE_DURATION 2.0
+#define MAX_VIDEO_QUEUE_DURATION 2.0
+#define MAX_QUEUE_SIZE (128 * 1024 * 1024)
 #define AV_SYNC_THRESHOLD 0.01
 #define AV_NOSYNC_THRESHOLD 1.0
+#define FRAME_DROP_WINDOW 32
+#define PRESENT_SPIN_MARGIN 0.002
+#define PRESENT_IDLE_WAIT_MS 100
+#define DEFAULT_REFRESH_RATE 60
+#define MAX_CADENCE_HOLD 8
+#define SEEK_SHORT_STEP 10.0
+#define SEEK_LONG_STEP 60.0
+#define KEYFRAME_INDEX_MAGIC 0x58495056
+#define KEYFRAME_INDEX_VERSION 1
+#define KEYFRAME_INDEX_MIN_FILE_SIZE (256ll * 1024 * 1024)
+#define CACHE_BLOCK_SIZE (1024 * 1024)
+#define MIN_CACHE_MB 4
+#define AVIO_BUFFER_SIZE (64 * 1024)
+#define MMAP_ADVISE_WINDOW (16 * 1024 * 1024)
+#define PICTURE_ALIGN 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define FAST_START_PROBESIZE (256 * 1024)
+#define FAST_START_ANALYZE_MS 500
+#define FAST_START_WINDOW_WIDTH 960
+#define FAST_START_WINDOW_HEIGHT 540
+#define PLAYLIST_PREFETCH_PACKETS 64
+#define PLAYLIST_PREFETCH_BYTES (4 * 1024 * 1024)
+#define PLAYLIST_BOUNDARY_STREAM -1
+#define MAX_PLAYERS 64
+#define STAGE_TIMER_BUCKETS 192
 #define FF_REFRESH_EVENT (SDL_USEREVENT)
 #define FF_QUIT_EVENT (SDL_USEREVENT + 1)
-#define VIDEO_PICTURE_QUEUE_SIZE 1
+#define FF_VIDEO_OPEN_EVENT (SDL_USEREVENT + 2)
+#define DEFAULT_PICTURE_QUEUE_SIZE 3
+#define MAX_PICTURE_QUEUE_SIZE 16
+#define TEXTURE_RING_SIZE 3
+#define GL_RENDERER_NAME 0x1F01
+#define PACKET_QUEUE_CAPACITY 1024
+#define MAX_WORKER_THREADS 64
+#define MAX_SCALER_SLICES 16
+#define MIN_SCALER_SLICE_HEIGHT 64
+#define LOG_RING_SIZE 4096
+#define MAX_LOG_THREADS 64
+#define LOG_FLUSH_INTERVAL_MS 50
+#define LOG_FILE_MAGIC 0x474c5056
+#define LOG_FILE_VERSION 1
+#define ALLOC_SITE_SLOTS 4096
+#define ALLOC_SITE_DEPTH 6
+#define ALLOC_STATS_WARMUP 2.0
+#define ALLOC_STATS_TOP_SITES 20
+
+#define LOG_ERROR   0
+#define LOG_WARNING 1
+#define LOG_INFO    2
+#define LOG_DEBUG   3
+#define LOG_TRACE   4
+
+#define TRACE_NO_PTS ( -1e300 )
 
 
 #define false 0
@@ -49,29 +120,560 @@ typedef U32 bool32;
 
 
 
-typedef struct packet_queue_t
+enum
+{
+    LOG_EVENT_THREAD,
+    LOG_EVENT_DROPPED,
+    LOG_EVENT_FRAME_TIMING,
+    LOG_EVENT_FRAME_SYNC,
+    LOG_EVENT_FRAME_SCHEDULE,
+    LOG_EVENT_FRAME_DISPLAY,
+    LOG_EVENT_SPAN,
+    LOG_EVENT_PLAYLIST_ITEM,
+    LOG_EVENT_COUNT
+};
+
+
+enum
+{
+    TRACE_DEMUX,
+    TRACE_PACKET_WAIT,
+    TRACE_SEND_PACKET,
+    TRACE_RECEIVE_FRAME,
+    TRACE_PICTURE_WAIT,
+    TRACE_CONVERT,
+    TRACE_REFRESH,
+    TRACE_UPLOAD,
+    TRACE_PRESENT,
+    TRACE_AUDIO_DECODE,
+    TRACE_AUDIO_RESAMPLE,
+    TRACE_AUDIO_RING_WAIT,
+    TRACE_AUDIO_CALLBACK,
+    TRACE_SPAN_COUNT
+};
+
+
+// fixed size binary event, formatted back into text only by the flusher or
+// by --decode-log.
+typedef struct log_record_t
+{
+    U64 time;
+    U16 event;
+    U8  level;
+    U8  thread;
+    U32 reserved;
+    union
+    {
+        F64  values [ 6 ];
+        char text   [ 48 ];
+    };
+	
+} log_record_t;
+
+
+// single producer (the owning thread), single consumer (the flusher).
+// released is set when the owner exits; the next new thread takes it over.
+typedef struct log_ring_t
+{
+    log_record_t  records [ LOG_RING_SIZE ];
+    SDL_atomic_t  write_index;
+    SDL_atomic_t  read_index;
+    SDL_atomic_t  dropped;
+    SDL_atomic_t  released;
+    U8            thread;
+	
+} log_ring_t;
+
+
+typedef struct log_file_header_t
+{
+    U32 magic;
+    U32 version;
+    U32 record_size;
+    U32 reserved;
+    U64 frequency;
+    U64 start;
+	
+} log_file_header_t;
+
+
+typedef struct logger_t
+{
+    S32           level;
+    FILE         *file;
+    SDL_TLSID     tls;
+    log_ring_t   *rings [ MAX_LOG_THREADS ];
+    SDL_atomic_t  num_rings;
+    SDL_Thread   *flusher;
+    SDL_sem      *wake;
+    SDL_atomic_t  quit;
+    U64           frequency;
+    U64           start;
+    char          names [ MAX_LOG_THREADS ][ 48 ];
+    FILE         *trace;
+    bool32        trace_started;
+	
+} logger_t;
+
+
+// state: 0 free, 1 being claimed, 2 frames valid.
+typedef struct alloc_site_t
+{
+    void         *frames [ ALLOC_SITE_DEPTH ];
+    S32           depth;
+    SDL_atomic_t  state;
+    SDL_atomic_t  count;
+	
+} alloc_site_t;
+
+
+typedef struct alloc_stats_t
+{
+    volatile S32  counting;
+    F64           start;
+    F64           stop;
+    SDL_atomic_t  lost;
+    alloc_site_t  sites [ ALLOC_SITE_SLOTS ];
+	
+} alloc_stats_t;
+
+
+typedef struct wait_point_t
 {
-    AVPacketList *first_packet;
-    AVPacketList *last_packet;
-    S32           num_packets;
-    S32           size;
     SDL_mutex    *mutex;
     SDL_cond     *condition;
+    SDL_atomic_t  num_waiters;
+
+} wait_point_t;
+
+
+// single producer / single consumer ring of preallocated packets.
+// head is only advanced by the producer, tail only by the consumer; the
+// mutexes in the wait points are touched only when one side has to sleep.
+// writable is shared by every queue the demuxer feeds, so it doubles as the
+// demuxer's "space available" signal.
+typedef struct packet_queue_t
+{
+    AVPacket    **packets;
+    S32          *durations;
+    S32          *serials;
+    U32           capacity;
+    SDL_atomic_t  head;
+    SDL_atomic_t  tail;
+    SDL_atomic_t  size;
+    SDL_atomic_t  duration;
+    SDL_atomic_t  eof;
+    SDL_atomic_t  abort_request;
+    SDL_atomic_t  serial;
+    AVRational    time_base;
+    S32           default_duration;
+    wait_point_t  readable;
+    wait_point_t *writable;
+    bool32       *quit;
+    SDL_atomic_t *interrupt;
 
 } packet_queue_t;
 
 
+// decoded, resampled PCM handed from the audio thread to the SDL callback.
+// write_index/read_index are running byte counts; only the writer ever sleeps.
+typedef struct pcm_ring_t
+{
+    U8           *data;
+    U32           capacity;
+    U32           limit;
+    SDL_atomic_t  write_index;
+    SDL_atomic_t  read_index;
+    SDL_atomic_t  writer_waiting;
+    SDL_sem      *writable;
+    SDL_atomic_t  abort_request;
+    SDL_atomic_t  primed;
+    SDL_atomic_t  finished;
+    SDL_atomic_t  underruns;
+    SDL_atomic_t  underrun_bytes;
+	
+} pcm_ring_t;
+
+
+typedef void ( *worker_job_t ) ( void *arg, S32 index );
+
+// fork/join pool: worker_pool_run hands out job indices until none are left,
+// with the calling thread taking jobs too.
+typedef struct worker_pool_t
+{
+    SDL_Thread   *threads [ MAX_WORKER_THREADS ];
+    S32           num_threads;
+    SDL_mutex    *lock;
+    SDL_sem      *start;
+    SDL_sem      *done;
+    SDL_atomic_t  next_job;
+    S32           num_jobs;
+    worker_job_t  job;
+    void         *job_arg;
+    SDL_atomic_t  quit;
+	
+} worker_pool_t;
+
+
+// one SwsContext per horizontal band so the bands can be converted in parallel.
+typedef struct sliced_scaler_t
+{
+    struct SwsContext  *contexts [ MAX_SCALER_SLICES ];
+    S32                 num_slices;
+    S32                 src_y [ MAX_SCALER_SLICES + 1 ];
+    S32                 dst_y [ MAX_SCALER_SLICES + 1 ];
+    S32                 src_width;
+    S32                 src_height;
+    enum AVPixelFormat  src_format;
+    S32                 dst_width;
+    S32                 dst_height;
+    enum AVPixelFormat  dst_format;
+    S32                 flags;
+	
+    const U8          **src_data;
+    const S32          *src_linesize;
+    U8                **dst_data;
+    const S32          *dst_linesize;
+	
+} sliced_scaler_t;
+
+
+// stage 0 only drops late pictures before conversion, stage 1 also makes the
+// decoder skip non-reference frames, stage 2 additionally skips the loop filter.
+typedef struct frame_drop_state_t
+{
+    S32 stage;
+    S32 window_frames;
+    S32 window_late;
+    S32 dropped;
+    S32 packets;
+    S32 decoded;
+	
+} frame_drop_state_t;
+
+
+// log-linear histogram of nanoseconds, four buckets per power of two.
+// Each stage is only ever timed from one thread.
+typedef struct stage_timer_t
+{
+    U64 count;
+    U64 total;
+    U64 max;
+    U32 buckets [ STAGE_TIMER_BUCKETS ];
+	
+} stage_timer_t;
+
+
+typedef struct occupancy_t
+{
+    U64 samples;
+    F64 total;
+    S32 max;
+	
+} occupancy_t;
+
+
+typedef struct pipeline_stats_t
+{
+    stage_timer_t demux;
+    stage_timer_t video_decode;
+    stage_timer_t video_convert;
+    stage_timer_t audio_decode;
+    stage_timer_t audio_resample;
+    occupancy_t   video_packets;
+    occupancy_t   audio_packets;
+    occupancy_t   pictures;
+    S32           video_frames;
+    S32           audio_frames;
+	
+} pipeline_stats_t;
+
+
+// presents on the main thread (SDL renderers belong to the thread that
+// created the window), at times aligned to the display refresh.
+typedef struct presenter_t
+{
+    F64    refresh_interval;
+    bool32 vsync;
+    bool32 scheduled;
+    F64    target;
+    F64    slot;
+    F64    wake;
+    F64    last_vsync;
+    F64    last_slot;
+    S32    last_hold;
+    S32    serial;
+    bool32 pulldown;
+    S32    presented;
+    S32    missed_vsyncs;
+    S32    cadence_breaks;
+    S32    holds [ MAX_CADENCE_HOLD + 1 ];
+    F64    jitter_total;
+    F64    jitter_squares;
+    F64    jitter_max;
+    F64    upload_cost;
+    S32    uploads_ahead;
+    S32    uploads_late;
+	
+} presenter_t;
+
+
+// <file>.vpidx: this header followed by count entries sorted by pts, in the
+// video stream's time base. Valid only for the exact file size and mtime.
+typedef struct keyframe_index_header_t
+{
+    U32 magic;
+    U32 version;
+    U64 file_size;
+    S64 file_mtime;
+    S32 stream_index;
+    S32 time_base_num;
+    S32 time_base_den;
+    U32 count;
+	
+} keyframe_index_header_t;
+
+
+typedef struct keyframe_index_entry_t
+{
+    S64 pts;
+    S64 pos;
+	
+} keyframe_index_entry_t;
+
+
+typedef struct keyframe_index_t
+{
+    const keyframe_index_header_t *header;
+    const keyframe_index_entry_t  *entries;
+    U64                            mapped_size;
+    bool32                         byte_seek;
+	
+    keyframe_index_entry_t        *building;
+    U32                            building_count;
+    U32                            building_capacity;
+    bool32                         build;
+	
+} keyframe_index_t;
+
+
+typedef struct cache_block_t
+{
+    S64 block;
+    S32 length;
+    S32 next;
+    U64 last_used;
+	
+} cache_block_t;
+
+
+// read-ahead block cache between avformat and the real protocol. The demux
+// thread reads through avio; a separate thread fills blocks ahead of the
+// read position, keeping a quarter of the cache behind it for short seeks
+// back. map hashes a block number to a chain of slots through next;
+// every block from the read position up to filled_block is cached.
+// Everything below is guarded by mutex.
+typedef struct read_cache_t
+{
+    AVIOContext   *source;
+    AVIOContext   *avio;
+    U8            *memory;
+    cache_block_t *blocks;
+    S32           *map;
+    S32            map_mask;
+    S32            num_blocks;
+    S64            file_size;
+    S64            position;
+    S64            filled_block;
+    S64            wanted_block;
+    S64            loading_block;
+    S64            eof_block;
+    bool32         error;
+    bool32         quit;
+    const bool32  *interrupt;
+    U64            clock;
+    SDL_mutex     *mutex;
+    SDL_cond      *block_ready;
+    SDL_cond      *wanted;
+    SDL_Thread    *thread;
+    U64            hits;
+    U64            misses;
+    U64            bytes_read;
+    U64            bytes_served;
+	
+} read_cache_t;
+
+
+// a local file mapped whole and read by avformat through a direct
+// AVIOContext: no read syscalls, one copy straight into packet buffers.
+typedef struct mapped_input_t
+{
+    U8          *data;
+    S64          size;
+    S64          position;
+    S64          advised_start;
+    S64          advised;
+    S64          dropped;
+    AVIOContext *avio;
+	
+} mapped_input_t;
+
+
+// an opened input and the streams picked from it.
+typedef struct media_input_t
+{
+    AVFormatContext *fmt_ctx;
+    read_cache_t    *read_cache;
+    mapped_input_t  *mapped_input;
+    S32              video_stream_index;
+    S32              audio_stream_index;
+	
+} media_input_t;
+
+
+// payload of the marker packet queued between two playlist items: the
+// consumer drains its decoder, then reuses or replaces it for codecpar.
+typedef struct playlist_boundary_t
+{
+    S32                item;
+    AVCodecParameters *codecpar;
+	
+} playlist_boundary_t;
+
+
+// the next playlist item, opened and pre-buffered while the current one plays.
+typedef struct playlist_prefetch_t
+{
+    SDL_Thread   *thread;
+    S32           position;
+    S32           result;
+    media_input_t input;
+    AVPacket     *packets [ PLAYLIST_PREFETCH_PACKETS ];
+    S32           num_packets;
+	
+} playlist_prefetch_t;
+
+
+// timestamps of item n are shifted past the end of item n - 1, so the
+// decoders, the audio clock and the presenter see one continuous timeline.
+typedef struct playlist_t
+{
+    char              **items;
+    S32                 count;
+    bool32              loop;
+    S32                 position;
+    S32                 sequence;
+    S64                 shift;
+    S64                 end;
+    F64                 start;
+    F64                 duration;
+    playlist_prefetch_t prefetch;
+    SDL_atomic_t        decoders_reused;
+    SDL_atomic_t        decoders_opened;
+	
+} playlist_t;
+
+
+typedef struct player_options_t
+{
+    const char *filename;
+    S32         audio_ring_ms;
+    S32         picture_queue_size;
+    S32         decoder_threads;
+    S32         decoder_thread_type;
+    bool32      bench;
+    bool32      no_audio;
+    bool32      accurate_seek;
+    bool32      build_index;
+    S32         cache_mb;
+    bool32      mmap_input;
+    S32         log_level;
+    const char *log_file;
+    const char *decode_log;
+    const char *trace_file;
+    bool32      fast_start;
+    S64         probesize;
+    S32         analyze_ms;
+    const char **inputs;
+    S32         num_inputs;
+    bool32      loop;
+    bool32      multi;
+    S32         num_players;
+    bool32      alloc_stats;
+    bool32      huge_pages;
+	
+} player_options_t;
+
+
+// presenter_now ( ) timestamps of the startup milestones, 0 until reached.
+typedef struct startup_times_t
+{
+    F64 launched;
+    F64 input_opened;
+    F64 streams_probed;
+    F64 codecs_opened;
+    F64 window_ready;
+    F64 first_frame;
+    F64 first_audio;
+	
+} startup_times_t;
+
+
+// frame is refcounted: decoder output is moved in and converted only when
+// it is uploaded; the null sink converts into a buffer from the picture
+// pool. Either goes back to its owner when the presenter releases the slot.
 typedef struct video_picture_t
 {
     AVFrame    *frame;
-    S32         width;
-    S32         height; 
-    bool32      allocated;
     F64         pts;
+    S32         serial;
+    S32         texture;
 	
 } video_picture_t;
 
 
+// picture buffers, all of one format and size: decoder output with
+// --huge-pages, converted pictures under --bench. allocated counts buffers
+// the pool had to create, the working set once it is flat. mutex is set
+// when decoder threads share the pool.
+typedef struct picture_pool_t
+{
+    SDL_mutex          *mutex;
+    AVBufferPool       *pool;
+    enum AVPixelFormat  format;
+    S32                 width;
+    S32                 height;
+    S32                 linesizes [ 4 ];
+    S32                 size;
+    bool32              huge_pages;
+    SDL_atomic_t        allocated;
+    S32                 reconfigured;
+	
+} picture_pool_t;
+
+
+// one per audio stream; the SwrContext and the output buffer live as long
+// as the input format, rate and layout stay the same.
+typedef struct audio_resampling_state_t
+{
+    SwrContext         *swr_ctx;
+	S64                 in_channel_layout;
+	S32                 in_sample_rate;
+	enum AVSampleFormat in_sample_fmt;
+	U64                 out_channel_layout;
+	S32                 out_sample_rate;
+	enum AVSampleFormat out_sample_fmt;
+	S32                 out_num_channels;
+	S32                 out_linesize;
+    S32                 in_num_samples;
+	S64                 out_num_samples;
+	S64                 max_out_num_samples;
+	U8                **resampled_data;
+    S32                 resampled_data_size;
+	
+} audio_resampling_state_t;
+
+
 typedef struct media_state_t
 {
     AVFormatContext    *fmt_ctx;
@@ -81,31 +683,54 @@ typedef struct media_state_t
     AVCodecContext     *audio_codec_ctx;
 	packet_queue_t      audio_queue;
 	U8                  audio_buffer [ ( MAX_AUDIO_FRAME_SIZE * 3 ) / 2 ];
-	U32                 audio_buffer_size;
-    U32                 audio_buffer_index;
-    AVFrame             audio_frame;
-    AVPacket            audio_packet;
+	pcm_ring_t          audio_ring;
+    AVFrame            *audio_frame;
+    AVPacket           *audio_packet;
 	U8                 *audio_packet_data;
     S32                 audio_packet_size;
 	
 	F64                 audio_clock;
+	F64                 audio_write_clock;
 	S32                 audio_hardware_buffer_size;
+	SDL_AudioDeviceID   audio_device;
+	S32                 audio_out_sample_rate;
+	S32                 audio_out_channels;
+	audio_resampling_state_t audio_resampler;
 	
 	S32                 video_stream_index;
     AVStream           *video_stream;
     AVCodecContext     *video_codec_ctx;
-    SDL_Texture        *texture;
+    SDL_Window         *screen;
+    SDL_mutex          *screen_mutex;
+    SDL_Texture        *textures [ TEXTURE_RING_SIZE ];
+    S32                 texture_write;
+    S32                 texture_shown;
+    S32                 uploaded;
+    bool32              software_output;
+    SDL_Surface        *converted_surface;
+    SDL_Rect            surface_rect;
     SDL_Renderer       *renderer;
+    U32                 texture_format;
+    enum AVPixelFormat  output_pix_fmt;
+    bool32              video_output_ready;
     packet_queue_t      video_queue;
-    struct SwsContext  *sws_ctx;
+    sliced_scaler_t     video_scaler;
+    picture_pool_t      picture_pool;
+    picture_pool_t      decoder_pool;
+    worker_pool_t      *workers;
+    wait_point_t        demux_space;
     
+	frame_drop_state_t  frame_drop;
+	pipeline_stats_t    stats;
+	presenter_t         presenter;
 	F64                 frame_timer;
     F64                 frame_last_pts;
     F64                 frame_last_delay;
     F64                 video_clock;
 	
 	
-	video_picture_t     picture_queue [ VIDEO_PICTURE_QUEUE_SIZE ];
+	video_picture_t    *picture_queue;
+	S32                 picture_queue_capacity;
 	S32                 picture_queue_size;
 	S32                 picture_queue_read_index;
 	S32                 picture_queue_write_index;
@@ -114,6 +739,29 @@ typedef struct media_state_t
 	
     SDL_Thread *    decode_thread_id;
     SDL_Thread *    video_thread_id;
+    SDL_Thread *    audio_thread_id;
+    SDL_atomic_t    video_finished;
+	
+	// seek request from the main thread, executed by the demux thread.
+	SDL_atomic_t    seek_request;
+	S64             seek_pos;
+	S64             seek_increment;
+	F64             seek_requested_at;
+	F64             seek_target;
+	S32             seek_serial;
+	S32             audio_serial;
+	keyframe_index_t keyframe_index;
+	read_cache_t    *read_cache;
+	mapped_input_t  *mapped_input;
+	S32             seek_count;
+	F64             seek_latency_total;
+	F64             seek_latency_max;
+	startup_times_t startup;
+	playlist_t      playlist;
+	S32             audio_item;
+	AVBufferRef    *audio_boundary;
+	
+	player_options_t options;
 	
 	S8 filename [ 1024 ];
 	
@@ -122,237 +770,5173 @@ typedef struct media_state_t
 } media_state_t;
 
 
-
-typedef struct audio_resampling_state_t
+// a stream_component_open call run on a helper thread (fast start).
+typedef struct codec_open_job_t
 {
-    SwrContext *swr_ctx;
-	S64         in_channel_layout;
-	U64         out_channel_layout;
-	S32         out_num_channels;
-	S32         out_linesize;
-    S32         in_num_samples;
-	S64         out_num_samples;
-	S64         max_out_num_samples;
-	U8        **resampled_data;
-    S32         resampled_data_size;
+    media_state_t *media_state;
+    S32            stream_index;
+    S32            result;
 	
-} audio_resampling_state_t;
+} codec_open_job_t;
 
 
-SDL_Window    *screen             = 0;
-SDL_mutex     *screen_mutex       = 0;
-media_state_t *global_media_state = 0;
 
 
 
-static S64 guess_correct_pts ( AVCodecContext *ctx, 
-							  S64 reordered_pts, 
-							  S64 dts )
+logger_t logger = { LOG_INFO };
+
+
+#define LOG_EVENT( log_level, event, ... ) \
+do \
+{ \
+    if ( ( log_level ) <= logger.level ) \
+    { \
+        F64 log_values_ [ 6 ] = { __VA_ARGS__ }; \
+        log_write ( log_level, event, log_values_ ); \
+    } \
+} while ( 0 )
+
+
+static const char *log_event_names [ LOG_EVENT_COUNT ] =
 {
-	S64 pts = AV_NOPTS_VALUE;
-	
-    if ( dts != AV_NOPTS_VALUE )
-    {
-        ctx->pts_correction_num_faulty_dts += dts <= ctx->pts_correction_last_dts;
-        ctx->pts_correction_last_dts = dts;
-    }
-    else if ( reordered_pts != AV_NOPTS_VALUE )
-    {
-        ctx->pts_correction_last_dts = reordered_pts;
-    }
-	
-    if ( reordered_pts != AV_NOPTS_VALUE )
-    {
-        ctx->pts_correction_num_faulty_pts += reordered_pts <= ctx->pts_correction_last_pts;
-        ctx->pts_correction_last_pts = reordered_pts;
-    }
-    else if ( dts != AV_NOPTS_VALUE )
-    {
-        ctx->pts_correction_last_pts = dts;
-    }
-	
-    if ( ( ctx->pts_correction_num_faulty_pts <= ctx->pts_correction_num_faulty_dts || dts == AV_NOPTS_VALUE ) && reordered_pts != AV_NOPTS_VALUE )
-    {
-        pts = reordered_pts;
-    }
-    else
-    {
-        pts = dts;
-    }
-	
-    return pts;
-}
+    "thread",
+    "dropped",
+    "frame_timing",
+    "frame_sync",
+    "frame_schedule",
+    "frame_display",
+    "span",
+    "playlist_item",
+};
 
 
-F64 synchronize_video( media_state_t* media_state,
-					  AVFrame * src_frame,
-					  F64 pts )
+static const char *trace_span_names [ TRACE_SPAN_COUNT ][ 2 ] =
 {
-	F64 frame_delay;
-	
-    if ( pts != 0 )
-    {
-        media_state->video_clock = pts;
-    }
-    else
-    {
-        pts = media_state->video_clock;
-    }
-	
-    frame_delay  = av_q2d ( media_state->video_codec_ctx->time_base );
-    frame_delay += src_frame->repeat_pict * ( frame_delay * 0.5 );
-    media_state->video_clock += frame_delay;
-	
-    return pts;
-}
+    { "demux",           "io"    },
+    { "packet wait",     "video" },
+    { "send_packet",     "video" },
+    { "receive_frame",   "video" },
+    { "picture wait",    "video" },
+    { "convert",         "video" },
+    { "refresh",         "video" },
+    { "texture upload",  "video" },
+    { "present",         "video" },
+    { "audio decode",    "audio" },
+    { "audio resample",  "audio" },
+    { "audio ring wait", "audio" },
+    { "audio callback",  "audio" },
+};
 
 
-int decode_thread ( void *arg )
+// TLS destructor, runs when a thread that logged exits.
+static void log_ring_release ( void *ring )
 {
-	media_state_t *media_state = ( media_state_t* ) arg;
-	AVFormatContext *fmt_ctx   = 0;
-	AVPacket packet            = { 0 };
-	S32 ret                    = -1;
+	SDL_AtomicSet ( &( ( log_ring_t* ) ring )->released, 1 );
+}
+
+// short lived threads (playlist prefetch, read-ahead, codec open) reuse the
+// rings of exited ones. Records keep their order, and the new thread's name
+// record relabels only what it writes after it.
+static log_ring_t *log_thread_ring ( void )
+{
+	log_ring_t *ring = SDL_TLSGet ( logger.tls );
 	
-	if ( avformat_open_input ( &fmt_ctx, media_state->filename, 0, 0 ) != 0 )
+	if ( !ring && logger.tls )
 	{
-		fprintf ( stderr, "Couldn't open file: %s\n", media_state->filename );
-		return -1;
+		S32 num_rings = FFMIN ( SDL_AtomicGet ( &logger.num_rings ), MAX_LOG_THREADS );
+		
+		for ( S32 i = 0; i < num_rings && !ring; i++ )
+		{
+			log_ring_t *released = SDL_AtomicGetPtr ( ( void** ) &logger.rings [ i ] );
+			
+			if ( released && SDL_AtomicCAS ( &released->released, 1, 0 ) )
+			{
+				ring = released;
+			}
+		}
+		
+		if ( !ring )
+		{
+			S32 index = SDL_AtomicAdd ( &logger.num_rings, 1 );
+			if ( index >= MAX_LOG_THREADS )
+			{
+				return 0;
+			}
+			
+			ring         = av_mallocz ( sizeof ( log_ring_t ) );
+			ring->thread = ( U8 ) index;
+			
+			SDL_AtomicSetPtr ( ( void** ) &logger.rings [ index ], ring );
+		}
+		
+		SDL_TLSSet ( logger.tls, ring, log_ring_release );
 	}
 	
+	return ring;
+}
+
+static log_record_t *log_begin ( log_ring_t *ring, S32 level, U16 event )
+{
+	S32 write_index = SDL_AtomicGet ( &ring->write_index );
 	
-	if ( avformat_find_stream_info ( fmt_ctx, 0 ) < 0 )
+	if ( write_index - SDL_AtomicGet ( &ring->read_index ) >= LOG_RING_SIZE )
 	{
-		fprintf ( stderr, "Couldn't find stream information %s\n", media_state->filename );
-		return -1; 
+		SDL_AtomicAdd ( &ring->dropped, 1 );
+		return 0;
 	}
 	
-	av_dump_format ( fmt_ctx, 0, media_state->filename, 0 );
-	
-	media_state->video_stream_index = -1;
-	media_state->audio_stream_index = -1;
-	
-	S32 video_stream_index = -1;
-	S32 audio_stream_index = -1;
+	log_record_t *record = &ring->records [ write_index & ( LOG_RING_SIZE - 1 ) ];
 	
+	record->time   = SDL_GetPerformanceCounter ( );
+	record->event  = event;
+	record->level  = ( U8 ) level;
+	record->thread = ring->thread;
 	
-	global_media_state   = media_state;
-	media_state->fmt_ctx = fmt_ctx;
-	
+	return record;
+}
+
+// never blocks: a full ring drops the event and counts it.
+void log_write ( S32 level, U16 event, const F64 *values )
+{
+	log_ring_t   *ring   = log_thread_ring ( );
+	log_record_t *record = ring ? log_begin ( ring, level, event ) : 0;
 	
-	for ( int i = 0; i < fmt_ctx->nb_streams; i++ )
+	if ( record )
 	{
-		if ( fmt_ctx->streams [ i ]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && video_stream_index < 0 ) 
-		{
-			video_stream_index = i;
-		}
-		
-		if ( fmt_ctx->streams [ i ]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && audio_stream_index < 0 ) 
-		{
-			audio_stream_index = i;
-		}
+		memcpy ( record->values, values, sizeof ( record->values ) );
+		SDL_AtomicAdd ( &ring->write_index, 1 );
 	}
+}
+
+void log_text ( S32 level, U16 event, const char *text )
+{
+	log_ring_t   *ring   = log_thread_ring ( );
+	log_record_t *record = ring ? log_begin ( ring, level, event ) : 0;
 	
-	if ( video_stream_index == -1 )
+	if ( record )
 	{
-		fprintf ( stderr, "Could not find a video stream\n" );
-		goto failure;
+		av_strlcpy ( record->text, text, sizeof ( record->text ) );
+		SDL_AtomicAdd ( &ring->write_index, 1 );
 	}
-	else
+}
+
+#define TRACE_NOW( ) ( logger.trace ? SDL_GetPerformanceCounter ( ) : 0 )
+
+// records [start, now] on the calling thread; pts tags the span with the
+// frame it belongs to, or TRACE_NO_PTS.
+void trace_span ( U16 span, U64 start, F64 pts )
+{
+	if ( !logger.trace )
 	{
-        if ( stream_component_open ( media_state, video_stream_index ) < 0 )
-        {
-            printf("Could not open video codec\n");
-            goto failure;
-        }
+		return;
 	}
 	
+	log_ring_t   *ring   = log_thread_ring ( );
+	log_record_t *record = ring ? log_begin ( ring, LOG_TRACE, LOG_EVENT_SPAN ) : 0;
 	
-	if ( audio_stream_index == -1 )
+	if ( record )
 	{
-		fprintf ( stderr, "Couldn't find a audio stream\n" );
-		return -1;
+		record->values [ 0 ] = span;
+		record->values [ 1 ] = ( F64 ) ( record->time - start );
+		record->values [ 2 ] = pts;
+		record->time         = start;
+		
+		SDL_AtomicAdd ( &ring->write_index, 1 );
 	}
-	else
+}
+
+// every thread that logs names itself once so the decoder can label its events.
+void log_thread_name ( const char *name )
+{
+	log_text ( LOG_ERROR, LOG_EVENT_THREAD, name );
+}
+
+void log_format ( FILE *out, const log_record_t *record, U64 frequency, U64 start, char names [ ][ 48 ] )
+{
+	const F64 *v = record->values;
+	
+	if ( record->event == LOG_EVENT_THREAD )
 	{
-        if ( stream_component_open ( media_state, audio_stream_index ) < 0 )
-        {
-            printf ( "Could not open audio codec\n" );
-            goto failure;
-        }
+		av_strlcpy ( names [ record->thread ], record->text, sizeof ( names [ 0 ] ) );
 	}
 	
-    if ( media_state->video_stream_index < 0 || media_state->audio_stream_index < 0)
-    {
-        printf ( "Could not open codecs: %s\n", media_state->filename );
-        goto failure;
-    }
+	fprintf ( out, "%12.6f %-16s %-14s ",
+			 ( F64 ) ( record->time - start ) / frequency,
+			 names [ record->thread ] [ 0 ] ? names [ record->thread ] : "?",
+			 record->event < LOG_EVENT_COUNT ? log_event_names [ record->event ] : "unknown" );
 	
+	switch ( record->event )
+	{
+		case LOG_EVENT_THREAD:
+		{
+			fprintf ( out, "%s\n", record->text );
+		} break;
+		
+		case LOG_EVENT_DROPPED:
+		{
+			fprintf ( out, "%.0f events lost, ring full\n", v [ 0 ] );
+		} break;
+		
+		case LOG_EVENT_FRAME_TIMING:
+		{
+			fprintf ( out, "pts %f last %f delay %f corrected %f\n", v [ 0 ], v [ 1 ], v [ 2 ], v [ 3 ] );
+		} break;
+		
+		case LOG_EVENT_FRAME_SYNC:
+		{
+			fprintf ( out, "audio clock %f av delay %f threshold %f delay %f\n", v [ 0 ], v [ 1 ], v [ 2 ], v [ 3 ] );
+		} break;
+		
+		case LOG_EVENT_FRAME_SCHEDULE:
+		{
+			fprintf ( out, "target in %f slot in %f aligned by %+.3f ms\n", v [ 0 ], v [ 1 ], v [ 2 ] * 1000 );
+		} break;
+		
+		case LOG_EVENT_FRAME_DISPLAY:
+		{
+			fprintf ( out, "%c (%.0f) pts %.0f dts %.0f %.0fx%.0f\n",
+					 av_get_picture_type_char ( ( enum AVPictureType ) v [ 0 ] ), v [ 1 ], v [ 2 ], v [ 3 ], v [ 4 ], v [ 5 ] );
+		} break;
+		
+		case LOG_EVENT_PLAYLIST_ITEM:
+		{
+			fprintf ( out, "item %.0f (#%.0f) starts at %.3f, %.0f packets prefetched\n", v [ 0 ], v [ 1 ], v [ 2 ], v [ 3 ] );
+		} break;
+		
+		default:
+		{
+			fprintf ( out, "%f %f %f %f %f %f\n", v [ 0 ], v [ 1 ], v [ 2 ], v [ 3 ], v [ 4 ], v [ 5 ] );
+		} break;
+	}
+}
+
+// chrome trace-event JSON, loadable in Perfetto or chrome://tracing.
+static void trace_emit ( const log_record_t *record )
+{
+	const F64 *v     = record->values;
+	F64 microseconds = 1e6 / logger.frequency;
+	
+	fprintf ( logger.trace, logger.trace_started ? ",\n" : "\n" );
+	logger.trace_started = true;
+	
+	if ( record->event == LOG_EVENT_THREAD )
+	{
+		fprintf ( logger.trace, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				 record->thread, record->text );
+		return;
+	}
+	
+	S32 span = FFMIN ( ( S32 ) v [ 0 ], TRACE_SPAN_COUNT - 1 );
+	
+	fprintf ( logger.trace, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d",
+			 trace_span_names [ span ][ 0 ],
+			 trace_span_names [ span ][ 1 ],
+			 ( F64 ) ( record->time - logger.start ) * microseconds,
+			 v [ 1 ] * microseconds,
+			 record->thread );
+	
+	if ( v [ 2 ] != TRACE_NO_PTS )
+	{
+		fprintf ( logger.trace, ",\"args\":{\"pts\":%.6f}", v [ 2 ] );
+	}
+	
+	fprintf ( logger.trace, "}" );
+}
+
+static void log_emit ( const log_record_t *record )
+{
+	if ( logger.trace && ( record->event == LOG_EVENT_SPAN || record->event == LOG_EVENT_THREAD ) )
+	{
+		trace_emit ( record );
+	}
+	
+	if ( record->event == LOG_EVENT_SPAN )
+	{
+		return;
+	}
+	
+	if ( logger.file )
+	{
+		fwrite ( record, sizeof ( *record ), 1, logger.file );
+	}
+	else if ( record->event == LOG_EVENT_THREAD )
+	{
+		av_strlcpy ( logger.names [ record->thread ], record->text, sizeof ( logger.names [ 0 ] ) );
+	}
+	else
+	{
+		log_format ( stdout, record, logger.frequency, logger.start, logger.names );
+	}
+}
+
+static void log_drain ( void )
+{
+	S32 num_rings = FFMIN ( SDL_AtomicGet ( &logger.num_rings ), MAX_LOG_THREADS );
+	
+	for ( S32 i = 0; i < num_rings; i++ )
+	{
+		log_ring_t *ring = SDL_AtomicGetPtr ( ( void** ) &logger.rings [ i ] );
+		if ( !ring )
+		{
+			continue;
+		}
+		
+		S32 read_index  = SDL_AtomicGet ( &ring->read_index );
+		S32 write_index = SDL_AtomicGet ( &ring->write_index );
+		
+		for ( ; read_index != write_index; read_index++ )
+		{
+			log_emit ( &ring->records [ read_index & ( LOG_RING_SIZE - 1 ) ] );
+		}
+		
+		SDL_AtomicSet ( &ring->read_index, read_index );
+		
+		S32 dropped = SDL_AtomicSet ( &ring->dropped, 0 );
+		if ( dropped )
+		{
+			log_record_t record = { 0 };
+			record.time         = SDL_GetPerformanceCounter ( );
+			record.event        = LOG_EVENT_DROPPED;
+			record.level        = LOG_WARNING;
+			record.thread       = ring->thread;
+			record.values [ 0 ] = dropped;
+			
+			log_emit ( &record );
+		}
+	}
+	
+	fflush ( logger.file ? logger.file : stdout );
+	
+	if ( logger.trace )
+	{
+		fflush ( logger.trace );
+	}
+}
+
+int log_flusher_thread ( void *arg )
+{
+	while ( !SDL_AtomicGet ( &logger.quit ) )
+	{
+		SDL_SemWaitTimeout ( logger.wake, LOG_FLUSH_INTERVAL_MS );
+		log_drain ( );
+	}
+	
+	log_drain ( );
+	
+	return 0;
+}
+
+S32 log_init ( S32 level, const char *path, const char *trace_path )
+{
+	logger.level     = level;
+	logger.tls       = SDL_TLSCreate ( );
+	logger.wake      = SDL_CreateSemaphore ( 0 );
+	logger.frequency = SDL_GetPerformanceFrequency ( );
+	logger.start     = SDL_GetPerformanceCounter ( );
+	
+	if ( path )
+	{
+		logger.file = fopen ( path, "wb" );
+		if ( !logger.file )
+		{
+			fprintf ( stderr, "Could not open log file %s\n", path );
+			return -1;
+		}
+		
+		log_file_header_t header = { 0 };
+		header.magic       = LOG_FILE_MAGIC;
+		header.version     = LOG_FILE_VERSION;
+		header.record_size = sizeof ( log_record_t );
+		header.frequency   = logger.frequency;
+		header.start       = logger.start;
+		
+		fwrite ( &header, sizeof ( header ), 1, logger.file );
+	}
+	
+	if ( trace_path )
+	{
+		logger.trace = fopen ( trace_path, "w" );
+		if ( !logger.trace )
+		{
+			fprintf ( stderr, "Could not open trace file %s\n", trace_path );
+			return -1;
+		}
+		
+		fprintf ( logger.trace, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" );
+	}
+	
+	logger.flusher = SDL_CreateThread ( log_flusher_thread, "Log Flusher", 0 );
+	
+	return 0;
+}
+
+void log_shutdown ( void )
+{
+	if ( logger.flusher )
+	{
+		SDL_AtomicSet    ( &logger.quit, true );
+		SDL_SemPost      ( logger.wake );
+		SDL_WaitThread   ( logger.flusher, 0 );
+		logger.flusher = 0;
+	}
+	
+	if ( logger.file )
+	{
+		fclose ( logger.file );
+		logger.file = 0;
+	}
+	
+	if ( logger.trace )
+	{
+		fprintf ( logger.trace, "\n]}\n" );
+		fclose  ( logger.trace );
+		logger.trace = 0;
+	}
+}
+
+// --decode-log: turns a binary log back into the text the flusher would print.
+S32 log_decode_file ( const char *path )
+{
+	static char       names [ MAX_LOG_THREADS ][ 48 ];
+	log_file_header_t header = { 0 };
+	log_record_t      record = { 0 };
+	
+	FILE *file = fopen ( path, "rb" );
+	if ( !file )
+	{
+		fprintf ( stderr, "Could not open log file %s\n", path );
+		return -1;
+	}
+	
+	if ( fread ( &header, sizeof ( header ), 1, file ) != 1 ||
+		header.magic != LOG_FILE_MAGIC ||
+		header.version != LOG_FILE_VERSION ||
+		header.record_size != sizeof ( log_record_t ) )
+	{
+		fprintf ( stderr, "%s is not a log written by this player\n", path );
+		fclose ( file );
+		return -1;
+	}
+	
+	while ( fread ( &record, sizeof ( record ), 1, file ) == 1 )
+	{
+		if ( record.thread < MAX_LOG_THREADS )
+		{
+			log_format ( stdout, &record, header.frequency, header.start, names );
+		}
+	}
+	
+	fclose ( file );
+	
+	return 0;
+}
+
+// --alloc-stats: every allocation made while counting is attributed to its
+// call stack. The hooks must not allocate themselves, so sites live in a
+// fixed open addressed table and are claimed with a compare and swap.
+static alloc_stats_t alloc_stats;
+
+static U32 alloc_site_hash ( void **frames, S32 depth )
+{
+	U64 hash = 1469598103934665603ull;
+	
+	for ( S32 i = 0; i < depth; i++ )
+	{
+		hash = ( hash ^ ( U64 ) ( size_t ) frames [ i ] ) * 1099511628211ull;
+	}
+	
+	return ( U32 ) ( hash ^ ( hash >> 32 ) );
+}
+
+static void alloc_stats_count ( void **frames, S32 depth )
+{
+	depth = FFMIN ( FFMAX ( depth, 0 ), ALLOC_SITE_DEPTH );
+	
+	U32 hash = alloc_site_hash ( frames, depth );
+	
+	for ( U32 probe = 0; probe < ALLOC_SITE_SLOTS; probe++ )
+	{
+		alloc_site_t *site  = &alloc_stats.sites [ ( hash + probe ) & ( ALLOC_SITE_SLOTS - 1 ) ];
+		S32           state = SDL_AtomicGet ( &site->state );
+		
+		if ( state == 0 && SDL_AtomicCAS ( &site->state, 0, 1 ) )
+		{
+			memcpy ( site->frames, frames, depth * sizeof ( void* ) );
+			site->depth = depth;
+			SDL_AtomicSet ( &site->state, 2 );
+			state = 2;
+		}
+		
+		// a slot still being filled in by another thread is skipped, at worst
+		// the same site ends up in two slots.
+		if ( state == 2 && site->depth == depth && !memcmp ( site->frames, frames, depth * sizeof ( void* ) ) )
+		{
+			SDL_AtomicAdd ( &site->count, 1 );
+			return;
+		}
+	}
+	
+	SDL_AtomicAdd ( &alloc_stats.lost, 1 );
+}
+
+
+#if defined ( ALLOC_STATS ) && defined ( __GLIBC__ )
+
+// opt in (-DALLOC_STATS, plus -rdynamic for symbol names): the executable's
+// definitions take precedence over libc's for every library in the process,
+// which would also override a preloaded allocator or a sanitizer's. The real
+// allocator stays reachable through __libc_*.
+extern void *__libc_malloc   ( size_t size );
+extern void *__libc_calloc   ( size_t count, size_t size );
+extern void *__libc_realloc  ( void *pointer, size_t size );
+extern void *__libc_memalign ( size_t alignment, size_t size );
+extern void  __libc_free     ( void *pointer );
+
+static __thread bool32 alloc_stats_busy;
+
+// frame 0 is the hook itself. backtrace can allocate on its first call in a
+// thread, the busy flag keeps that from recursing.
+#define ALLOC_STATS_RECORD( ) \
+if ( alloc_stats.counting && !alloc_stats_busy ) \
+{ \
+	void *frames [ ALLOC_SITE_DEPTH + 1 ]; \
+	alloc_stats_busy = true; \
+	S32 depth = backtrace ( frames, ALLOC_SITE_DEPTH + 1 ); \
+	alloc_stats_count ( frames + 1, depth - 1 ); \
+	alloc_stats_busy = false; \
+}
+
+void *malloc ( size_t size )
+{
+	ALLOC_STATS_RECORD ( );
+	return __libc_malloc ( size );
+}
+
+void *calloc ( size_t count, size_t size )
+{
+	ALLOC_STATS_RECORD ( );
+	return __libc_calloc ( count, size );
+}
+
+void *realloc ( void *pointer, size_t size )
+{
+	ALLOC_STATS_RECORD ( );
+	return __libc_realloc ( pointer, size );
+}
+
+void *memalign ( size_t alignment, size_t size )
+{
+	ALLOC_STATS_RECORD ( );
+	return __libc_memalign ( alignment, size );
+}
+
+void *aligned_alloc ( size_t alignment, size_t size )
+{
+	ALLOC_STATS_RECORD ( );
+	return __libc_memalign ( alignment, size );
+}
+
+// av_malloc goes through here.
+int posix_memalign ( void **pointer, size_t alignment, size_t size )
+{
+	ALLOC_STATS_RECORD ( );
+	
+	if ( alignment < sizeof ( void* ) || ( alignment & ( alignment - 1 ) ) )
+	{
+		return EINVAL;
+	}
+	
+	*pointer = __libc_memalign ( alignment, size );
+	return *pointer || !size ? 0 : ENOMEM;
+}
+
+void free ( void *pointer )
+{
+	__libc_free ( pointer );
+}
+
+static bool32 alloc_stats_install ( void )
+{
+	void *frames [ 1 ];
+	
+	// loads the unwinder now rather than inside the first counted allocation.
+	backtrace ( frames, 1 );
+	return true;
+}
+
+static void alloc_stats_print_site ( alloc_site_t *site )
+{
+	fflush ( stdout );
+	backtrace_symbols_fd ( site->frames, site->depth, STDOUT_FILENO );
+}
+
+#elif defined ( WIN32 ) && defined ( _DEBUG )
+
+// the debug CRT reports every heap operation to the hook before performing it.
+static int alloc_stats_hook ( int type, void *data, size_t size, int block_type, long request, const unsigned char *file, int line )
+{
+	if ( alloc_stats.counting && ( type == _HOOK_ALLOC || type == _HOOK_REALLOC ) && block_type != _CRT_BLOCK )
+	{
+		void *frames [ ALLOC_SITE_DEPTH ];
+		S32   depth = CaptureStackBackTrace ( 1, ALLOC_SITE_DEPTH, frames, 0 );
+		
+		alloc_stats_count ( frames, depth );
+	}
+	
+	return TRUE;
+}
+
+static bool32 alloc_stats_install ( void )
+{
+	_CrtSetAllocHook ( alloc_stats_hook );
+	return true;
+}
+
+// module+offset, resolve against the pdb with a debugger or dbh.
+static void alloc_stats_print_site ( alloc_site_t *site )
+{
+	for ( S32 i = 0; i < site->depth; i++ )
+	{
+		HMODULE module = 0;
+		char    path [ MAX_PATH ] = "?";
+		
+		if ( GetModuleHandleExA ( GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, ( LPCSTR ) site->frames [ i ], &module ) )
+		{
+			GetModuleFileNameA ( module, path, sizeof ( path ) );
+		}
+		
+		const char *name = FFMAX ( strrchr ( path, '\\' ), strrchr ( path, '/' ) );
+		printf ( "%s+0x%llx\n", name ? name + 1 : path, ( U64 ) ( ( U8* ) site->frames [ i ] - ( U8* ) module ) );
+	}
+}
+
+#else
+
+static bool32 alloc_stats_install ( void )
+{
+	fprintf ( stderr, "--alloc-stats needs a glibc build with -DALLOC_STATS or the debug CRT\n" );
+	return false;
+}
+
+static void alloc_stats_print_site ( alloc_site_t *site )
+{
+}
+
+#endif
+
+
+
+
+void wait_point_init ( wait_point_t *wait_point )
+{
+	memset ( wait_point, 0, sizeof ( wait_point_t ) );
+	wait_point->mutex = SDL_CreateMutex ( );
+	if ( !wait_point->mutex )
+	{
+		fprintf ( stderr, "SDL_CreateMutex Error: %s\n", SDL_GetError ( ) );
+		return;
+	}
+	
+	wait_point->condition = SDL_CreateCond ( );
+	if ( !wait_point->condition )
+	{
+		fprintf ( stderr, "SDL_CreateCond Error: %s\n", SDL_GetError ( ) );
+		return;
+	}
+}
+
+void wait_point_destroy ( wait_point_t *wait_point )
+{
+	SDL_DestroyCond  ( wait_point->condition );
+	SDL_DestroyMutex ( wait_point->mutex );
+	memset ( wait_point, 0, sizeof ( wait_point_t ) );
+}
+
+// SDL_AtomicAdd is a full barrier, so a waiter that registered itself
+// before re-checking its predicate can never miss a publish made on the other side.
+void wait_point_signal ( wait_point_t *wait_point )
+{
+	if ( SDL_AtomicGet ( &wait_point->num_waiters ) > 0 )
+	{
+		SDL_LockMutex   ( wait_point->mutex );
+		SDL_CondBroadcast ( wait_point->condition );
+		SDL_UnlockMutex ( wait_point->mutex );
+	}
+}
+
+void wait_point_enter ( wait_point_t *wait_point )
+{
+	SDL_LockMutex ( wait_point->mutex );
+	SDL_AtomicAdd ( &wait_point->num_waiters, 1 );
+}
+
+void wait_point_leave ( wait_point_t *wait_point )
+{
+	SDL_AtomicAdd   ( &wait_point->num_waiters, -1 );
+	SDL_UnlockMutex ( wait_point->mutex );
+}
+
+
+// quit and interrupt belong to the owning player: quit ends every wait,
+// interrupt (a pending seek) makes a put on a full queue give up.
+void packet_queue_init ( packet_queue_t *queue, AVStream *stream, wait_point_t *writable, bool32 *quit, SDL_atomic_t *interrupt )
+{
+	memset ( queue, 0, sizeof ( packet_queue_t ) );
+	
+	queue->capacity  = PACKET_QUEUE_CAPACITY;
+	queue->packets   = av_mallocz ( queue->capacity * sizeof ( AVPacket* ) );
+	queue->durations = av_mallocz ( queue->capacity * sizeof ( S32 ) );
+	queue->serials   = av_mallocz ( queue->capacity * sizeof ( S32 ) );
+	queue->time_base = stream->time_base;
+	queue->writable  = writable;
+	queue->quit      = quit;
+	queue->interrupt = interrupt;
+	assert ( queue->packets && queue->durations && queue->serials );
+	
+	if ( stream->avg_frame_rate.num > 0 && stream->avg_frame_rate.den > 0 )
+	{
+		queue->default_duration = ( S32 ) ( 1000 * ( S64 ) stream->avg_frame_rate.den / stream->avg_frame_rate.num );
+	}
+	
+	for ( U32 i = 0; i < queue->capacity; i++ )
+	{
+		queue->packets [ i ] = av_packet_alloc ( );
+		assert ( queue->packets [ i ] );
+	}
+	
+	wait_point_init ( &queue->readable );
+}
+
+void packet_queue_destroy ( packet_queue_t *queue )
+{
+	if ( !queue->packets )
+	{
+		return;
+	}
+	
+	for ( U32 i = 0; i < queue->capacity; i++ )
+	{
+		av_packet_free ( &queue->packets [ i ] );
+	}
+	
+	av_freep ( &queue->packets );
+	av_freep ( &queue->durations );
+	av_freep ( &queue->serials );
+	wait_point_destroy ( &queue->readable );
+}
+
+S32 packet_queue_count ( packet_queue_t *queue )
+{
+	return ( S32 ) ( ( U32 ) SDL_AtomicGet ( &queue->head ) - ( U32 ) SDL_AtomicGet ( &queue->tail ) );
+}
+
+void packet_queue_abort ( packet_queue_t *queue )
+{
+	if ( !queue->packets )
+	{
+		return;
+	}
+	
+	SDL_AtomicSet ( &queue->abort_request, true );
+	
+	SDL_LockMutex     ( queue->readable.mutex );
+	SDL_CondBroadcast ( queue->readable.condition );
+	SDL_UnlockMutex   ( queue->readable.mutex );
+	
+	SDL_LockMutex     ( queue->writable->mutex );
+	SDL_CondBroadcast ( queue->writable->condition );
+	SDL_UnlockMutex   ( queue->writable->mutex );
+}
+
+// demux thread only, right after a seek. Packets already queued keep their
+// old serial and are thrown away by the consumer; the serial change also
+// tells the consumer to flush its decoder.
+void packet_queue_flush ( packet_queue_t *queue )
+{
+	if ( !queue->packets )
+	{
+		return;
+	}
+	
+	SDL_AtomicSet ( &queue->eof, false );
+	SDL_AtomicAdd ( &queue->serial, 1 );
+	
+	wait_point_signal ( &queue->readable );
+}
+
+void packet_queue_set_eof ( packet_queue_t *queue )
+{
+	if ( !queue->packets )
+	{
+		return;
+	}
+	
+	SDL_AtomicSet ( &queue->eof, true );
+	
+	SDL_LockMutex     ( queue->readable.mutex );
+	SDL_CondBroadcast ( queue->readable.condition );
+	SDL_UnlockMutex   ( queue->readable.mutex );
+}
+
+int packet_queue_put ( packet_queue_t *queue, AVPacket *packet )
+{
+	U32 head = ( U32 ) SDL_AtomicGet ( &queue->head );
+	
+	if ( head - ( U32 ) SDL_AtomicGet ( &queue->tail ) >= queue->capacity )
+	{
+		wait_point_enter ( queue->writable );
+		
+		while ( head - ( U32 ) SDL_AtomicGet ( &queue->tail ) >= queue->capacity &&
+			   !SDL_AtomicGet ( &queue->abort_request ) && !SDL_AtomicGet ( queue->interrupt ) )
+		{
+			SDL_CondWait ( queue->writable->condition, queue->writable->mutex );
+		}
+		
+		wait_point_leave ( queue->writable );
+	}
+	
+	// a pending seek is about to invalidate everything queued, this packet included.
+	if ( SDL_AtomicGet ( &queue->abort_request ) || head - ( U32 ) SDL_AtomicGet ( &queue->tail ) >= queue->capacity )
+	{
+		av_packet_unref ( packet );
+		return -1;
+	}
+	
+	AVPacket *slot = queue->packets [ head & ( queue->capacity - 1 ) ];
+	S32 duration   = queue->default_duration;
+	
+	if ( packet->duration > 0 )
+	{
+		duration = ( S32 ) av_rescale_q ( packet->duration, queue->time_base, ( AVRational ) { 1, 1000 } );
+	}
+	
+	av_packet_move_ref ( slot, packet );
+	
+	queue->durations [ head & ( queue->capacity - 1 ) ] = duration;
+	queue->serials   [ head & ( queue->capacity - 1 ) ] = SDL_AtomicGet ( &queue->serial );
+	
+	SDL_AtomicAdd ( &queue->size,     slot->size );
+	SDL_AtomicAdd ( &queue->duration, duration   );
+	SDL_AtomicAdd ( &queue->head, 1 );
+	
+	wait_point_signal ( &queue->readable );
+	
+	return 0;
+}
+
+// returns the packet's serial through serial; packets from before the last
+// flush are dropped here and never returned.
+int packet_queue_get ( packet_queue_t *queue, AVPacket *packet, int block, S32 *serial )
+{
+	U32 tail = ( U32 ) SDL_AtomicGet ( &queue->tail );
+	
+	for ( ;; )
+	{
+		if ( *queue->quit || SDL_AtomicGet ( &queue->abort_request ) )
+		{
+			return -1;
+		}
+		
+		if ( ( U32 ) SDL_AtomicGet ( &queue->head ) != tail )
+		{
+			AVPacket *slot = queue->packets [ tail & ( queue->capacity - 1 ) ];
+			
+			if ( queue->serials [ tail & ( queue->capacity - 1 ) ] == SDL_AtomicGet ( &queue->serial ) )
+			{
+				break;
+			}
+			
+			SDL_AtomicAdd ( &queue->size,     -slot->size );
+			SDL_AtomicAdd ( &queue->duration, -queue->durations [ tail & ( queue->capacity - 1 ) ] );
+			
+			av_packet_unref ( slot );
+			
+			SDL_AtomicSet ( &queue->tail, ++tail );
+			
+			wait_point_signal ( queue->writable );
+			continue;
+		}
+		
+		if ( SDL_AtomicGet ( &queue->eof ) )
+		{
+			return -1;
+		}
+		
+		if ( !block )
+		{
+			return 0;
+		}
+		
+		wait_point_enter ( &queue->readable );
+		
+		while ( ( U32 ) SDL_AtomicGet ( &queue->head ) == tail && !SDL_AtomicGet ( &queue->eof ) &&
+			   !SDL_AtomicGet ( &queue->abort_request ) && !*queue->quit )
+		{
+			SDL_CondWait ( queue->readable.condition, queue->readable.mutex );
+		}
+		
+		wait_point_leave ( &queue->readable );
+	}
+	
+	AVPacket *slot = queue->packets [ tail & ( queue->capacity - 1 ) ];
+	
+	SDL_AtomicAdd ( &queue->size,     -slot->size );
+	SDL_AtomicAdd ( &queue->duration, -queue->durations [ tail & ( queue->capacity - 1 ) ] );
+	
+	*serial = queue->serials [ tail & ( queue->capacity - 1 ) ];
+	
+	av_packet_move_ref ( packet, slot );
+	
+	SDL_AtomicAdd ( &queue->tail, 1 );
+	
+	wait_point_signal ( queue->writable );
+	
+	return 1;
+}
+
+// after end of stream: blocks until a seek brings new packets, or quit.
+int packet_queue_wait ( packet_queue_t *queue )
+{
+	wait_point_enter ( &queue->readable );
+	
+	while ( ( U32 ) SDL_AtomicGet ( &queue->head ) == ( U32 ) SDL_AtomicGet ( &queue->tail ) &&
+		   !SDL_AtomicGet ( &queue->abort_request ) && !*queue->quit )
+	{
+		SDL_CondWait ( queue->readable.condition, queue->readable.mutex );
+	}
+	
+	wait_point_leave ( &queue->readable );
+	
+	return SDL_AtomicGet ( &queue->abort_request ) || *queue->quit ? -1 : 0;
+}
+
+
+void pcm_ring_init ( pcm_ring_t *ring, U32 size )
+{
+	memset ( ring, 0, sizeof ( pcm_ring_t ) );
+	
+	ring->capacity = 1;
+	while ( ring->capacity < size )
+	{
+		ring->capacity <<= 1;
+	}
+	
+	ring->limit    = size;
+	ring->data     = av_mallocz ( ring->capacity );
+	ring->writable = SDL_CreateSemaphore ( 0 );
+	assert ( ring->data && ring->writable );
+}
+
+void pcm_ring_destroy ( pcm_ring_t *ring )
+{
+	if ( ring->writable )
+	{
+		SDL_DestroySemaphore ( ring->writable );
+	}
+	
+	av_freep ( &ring->data );
+	ring->writable = 0;
+}
+
+U32 pcm_ring_fill ( pcm_ring_t *ring )
+{
+	return ( U32 ) SDL_AtomicGet ( &ring->write_index ) - ( U32 ) SDL_AtomicGet ( &ring->read_index );
+}
+
+void pcm_ring_abort ( pcm_ring_t *ring )
+{
+	if ( !ring->data )
+	{
+		return;
+	}
+	
+	SDL_AtomicSet ( &ring->abort_request, true );
+	SDL_SemPost   ( ring->writable );
+}
+
+// writer side, after a seek. The callback is locked out while the read index
+// jumps, so it never plays half of the discarded audio.
+void pcm_ring_flush ( pcm_ring_t *ring, SDL_AudioDeviceID device )
+{
+	SDL_LockAudioDevice ( device );
+	
+	SDL_AtomicSet ( &ring->read_index, SDL_AtomicGet ( &ring->write_index ) );
+	SDL_AtomicSet ( &ring->primed, false );
+	
+	SDL_UnlockAudioDevice ( device );
+}
+
+// blocks until every byte is in the ring; returns -1 if the ring was aborted.
+int pcm_ring_write ( pcm_ring_t *ring, const U8 *data, U32 size )
+{
+	while ( size > 0 )
+	{
+		U32 write_index = ( U32 ) SDL_AtomicGet ( &ring->write_index );
+		U32 space       = 0;
+		
+		for ( ; ; )
+		{
+			if ( SDL_AtomicGet ( &ring->abort_request ) )
+			{
+				return -1;
+			}
+			
+			space = ring->limit - ( write_index - ( U32 ) SDL_AtomicGet ( &ring->read_index ) );
+			if ( ( S32 ) space > 0 )
+			{
+				break;
+			}
+			
+			SDL_AtomicAdd ( &ring->writer_waiting, 1 );
+			
+			space = ring->limit - ( write_index - ( U32 ) SDL_AtomicGet ( &ring->read_index ) );
+			if ( ( S32 ) space <= 0 && !SDL_AtomicGet ( &ring->abort_request ) )
+			{
+				SDL_SemWait ( ring->writable );
+			}
+			
+			SDL_AtomicAdd ( &ring->writer_waiting, -1 );
+		}
+		
+		U32 offset = write_index & ( ring->capacity - 1 );
+		U32 chunk  = FFMIN ( FFMIN ( size, space ), ring->capacity - offset );
+		
+		memcpy ( ring->data + offset, data, chunk );
+		
+		SDL_AtomicAdd ( &ring->write_index, chunk );
+		SDL_AtomicSet ( &ring->primed, true );
+		
+		data += chunk;
+		size -= chunk;
+	}
+	
+	return 0;
+}
+
+// called from the audio callback: never blocks, never allocates.
+U32 pcm_ring_read ( pcm_ring_t *ring, U8 *data, U32 size )
+{
+	U32 read_index = ( U32 ) SDL_AtomicGet ( &ring->read_index );
+	U32 available  = ( U32 ) SDL_AtomicGet ( &ring->write_index ) - read_index;
+	U32 total      = FFMIN ( size, available );
+	U32 copied     = 0;
+	
+	while ( copied < total )
+	{
+		U32 offset = ( read_index + copied ) & ( ring->capacity - 1 );
+		U32 chunk  = FFMIN ( total - copied, ring->capacity - offset );
+		
+		memcpy ( data + copied, ring->data + offset, chunk );
+		copied += chunk;
+	}
+	
+	if ( copied > 0 )
+	{
+		SDL_AtomicAdd ( &ring->read_index, copied );
+		
+		if ( SDL_AtomicGet ( &ring->writer_waiting ) > 0 )
+		{
+			SDL_SemPost ( ring->writable );
+		}
+	}
+	
+	return copied;
+}
+
+
+int worker_thread ( void *arg )
+{
+	worker_pool_t *pool = ( worker_pool_t* ) arg;
+	
+	for ( ; ; )
+	{
+		SDL_SemWait ( pool->start );
+		
+		if ( SDL_AtomicGet ( &pool->quit ) )
+		{
+			break;
+		}
+		
+		for ( S32 index = SDL_AtomicAdd ( &pool->next_job, 1 ); index < pool->num_jobs; index = SDL_AtomicAdd ( &pool->next_job, 1 ) )
+		{
+			pool->job ( pool->job_arg, index );
+		}
+		
+		SDL_SemPost ( pool->done );
+	}
+	
+	return 0;
+}
+
+void worker_pool_init ( worker_pool_t *pool, S32 num_threads )
+{
+	memset ( pool, 0, sizeof ( worker_pool_t ) );
+	
+	pool->lock  = SDL_CreateMutex ( );
+	pool->start = SDL_CreateSemaphore ( 0 );
+	pool->done  = SDL_CreateSemaphore ( 0 );
+	
+	num_threads = FFMIN ( FFMAX ( num_threads, 0 ), MAX_WORKER_THREADS );
+	
+	for ( S32 i = 0; i < num_threads; i++ )
+	{
+		pool->threads [ pool->num_threads ] = SDL_CreateThread ( worker_thread, "Worker Thread", pool );
+		if ( pool->threads [ pool->num_threads ] )
+		{
+			pool->num_threads++;
+		}
+	}
+}
+
+void worker_pool_run ( worker_pool_t *pool, worker_job_t job, void *arg, S32 num_jobs )
+{
+	if ( !pool || pool->num_threads == 0 || num_jobs <= 1 )
+	{
+		for ( S32 index = 0; index < num_jobs; index++ )
+		{
+			job ( arg, index );
+		}
+		return;
+	}
+	
+	SDL_LockMutex ( pool->lock );
+	
+	S32 num_woken = FFMIN ( pool->num_threads, num_jobs - 1 );
+	
+	pool->job      = job;
+	pool->job_arg  = arg;
+	pool->num_jobs = num_jobs;
+	SDL_AtomicSet ( &pool->next_job, 0 );
+	
+	for ( S32 i = 0; i < num_woken; i++ )
+	{
+		SDL_SemPost ( pool->start );
+	}
+	
+	for ( S32 index = SDL_AtomicAdd ( &pool->next_job, 1 ); index < num_jobs; index = SDL_AtomicAdd ( &pool->next_job, 1 ) )
+	{
+		job ( arg, index );
+	}
+	
+	for ( S32 i = 0; i < num_woken; i++ )
+	{
+		SDL_SemWait ( pool->done );
+	}
+	
+	SDL_UnlockMutex ( pool->lock );
+}
+
+
+void sliced_scaler_free ( sliced_scaler_t *scaler )
+{
+	for ( S32 i = 0; i < scaler->num_slices; i++ )
+	{
+		sws_freeContext ( scaler->contexts [ i ] );
+		scaler->contexts [ i ] = 0;
+	}
+	
+	scaler->num_slices = 0;
+}
+
+// bands start on rows that are a multiple of the chroma subsampling of both
+// formats, so every band's chroma rows line up with its luma rows.
+int sliced_scaler_configure ( sliced_scaler_t *scaler,
+							 S32 src_width, S32 src_height, enum AVPixelFormat src_format,
+							 S32 dst_width, S32 dst_height, enum AVPixelFormat dst_format,
+							 S32 flags, S32 max_slices )
+{
+	if ( scaler->num_slices > 0                &&
+		scaler->src_width  == src_width        &&
+		scaler->src_height == src_height       &&
+		scaler->src_format == src_format       &&
+		scaler->dst_width  == dst_width        &&
+		scaler->dst_height == dst_height       &&
+		scaler->dst_format == dst_format       &&
+		scaler->flags      == flags )
+	{
+		return 0;
+	}
+	
+	sliced_scaler_free ( scaler );
+	
+	const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get ( src_format );
+	const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get ( dst_format );
+	if ( !src_desc || !dst_desc )
+	{
+		return -1;
+	}
+	
+	S32 align      = 1 << FFMAX ( FFMAX ( src_desc->log2_chroma_h, dst_desc->log2_chroma_h ), 1 );
+	S32 num_slices = FFMIN ( FFMIN ( max_slices, MAX_SCALER_SLICES ), FFMAX ( FFMIN ( src_height, dst_height ) / MIN_SCALER_SLICE_HEIGHT, 1 ) );
+	
+	// bands are scaled independently: with a vertical scale each would clamp
+	// its filter at the band edges and round its own ratio, leaving seams.
+	// Such conversions run as one band.
+	if ( src_height != dst_height )
+	{
+		num_slices = 1;
+	}
+	
+	num_slices = FFMAX ( num_slices, 1 );
+	
+	scaler->src_y [ 0 ] = 0;
+	scaler->dst_y [ 0 ] = 0;
+	
+	for ( S32 i = 1; i < num_slices; i++ )
+	{
+		scaler->dst_y [ i ] = ( ( S64 ) dst_height * i / num_slices ) & ~( align - 1 );
+		scaler->src_y [ i ] = ( ( S64 ) src_height * scaler->dst_y [ i ] / dst_height ) & ~( align - 1 );
+	}
+	
+	scaler->src_y [ num_slices ] = src_height;
+	scaler->dst_y [ num_slices ] = dst_height;
+	
+	for ( S32 i = 0; i < num_slices; i++ )
+	{
+		scaler->contexts [ i ] = sws_getContext ( src_width,
+												 scaler->src_y [ i + 1 ] - scaler->src_y [ i ],
+												 src_format,
+												 dst_width,
+												 scaler->dst_y [ i + 1 ] - scaler->dst_y [ i ],
+												 dst_format,
+												 flags,
+												 0,
+												 0,
+												 0 );
+		if ( !scaler->contexts [ i ] )
+		{
+			scaler->num_slices = i;
+			sliced_scaler_free ( scaler );
+			return -1;
+		}
+	}
+	
+	scaler->num_slices = num_slices;
+	scaler->src_width  = src_width;
+	scaler->src_height = src_height;
+	scaler->src_format = src_format;
+	scaler->dst_width  = dst_width;
+	scaler->dst_height = dst_height;
+	scaler->dst_format = dst_format;
+	scaler->flags      = flags;
+	
+	return 0;
+}
+
+static void offset_planes ( enum AVPixelFormat format, S32 y, U8 **data, const S32 *linesize, U8 **out )
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get ( format );
+	
+	for ( S32 plane = 0; plane < 4; plane++ )
+	{
+		S32 shift = ( plane == 1 || plane == 2 ) ? desc->log2_chroma_h : 0;
+		
+		out [ plane ] = data [ plane ];
+		
+		if ( data [ plane ] && !( plane == 1 && ( desc->flags & AV_PIX_FMT_FLAG_PAL ) ) )
+		{
+			out [ plane ] += ( ptrdiff_t ) ( y >> shift ) * linesize [ plane ];
+		}
+	}
+}
+
+static void sliced_scaler_job ( void *arg, S32 index )
+{
+	sliced_scaler_t *scaler = ( sliced_scaler_t* ) arg;
+	U8 *src [ 4 ];
+	U8 *dst [ 4 ];
+	
+	offset_planes ( scaler->src_format, scaler->src_y [ index ], ( U8** ) scaler->src_data, scaler->src_linesize, src );
+	offset_planes ( scaler->dst_format, scaler->dst_y [ index ], scaler->dst_data,          scaler->dst_linesize, dst );
+	
+	sws_scale ( scaler->contexts [ index ],
+			   ( U8 const* const* ) src,
+			   scaler->src_linesize,
+			   0,
+			   scaler->src_y [ index + 1 ] - scaler->src_y [ index ],
+			   dst,
+			   scaler->dst_linesize );
+}
+
+void sliced_scaler_scale ( sliced_scaler_t *scaler, worker_pool_t *pool,
+						  const U8 **src_data, const S32 *src_linesize,
+						  U8 **dst_data, const S32 *dst_linesize )
+{
+	scaler->src_data     = src_data;
+	scaler->src_linesize = src_linesize;
+	scaler->dst_data     = dst_data;
+	scaler->dst_linesize = dst_linesize;
+	
+	worker_pool_run ( pool, sliced_scaler_job, scaler, scaler->num_slices );
+}
+
+
+U64 stage_timer_start ( void )
+{
+	return SDL_GetPerformanceCounter ( );
+}
+
+void stage_timer_stop ( stage_timer_t *timer, U64 start )
+{
+	U64 ns    = ( SDL_GetPerformanceCounter ( ) - start ) * 1000000000ull / SDL_GetPerformanceFrequency ( );
+	S32 index = 0;
+	
+	if ( ns >= 4 )
+	{
+		S32 octave = 2;
+		
+		while ( ( ns >> ( octave + 1 ) ) != 0 )
+		{
+			octave++;
+		}
+		
+		index = octave * 4 + ( S32 ) ( ( ns >> ( octave - 2 ) ) & 3 );
+	}
+	else
+	{
+		index = ( S32 ) ns;
+	}
+	
+	timer->buckets [ FFMIN ( index, STAGE_TIMER_BUCKETS - 1 ) ]++;
+	timer->count++;
+	timer->total += ns;
+	timer->max    = FFMAX ( timer->max, ns );
+}
+
+F64 presenter_now ( void )
+{
+	return ( F64 ) SDL_GetPerformanceCounter ( ) / SDL_GetPerformanceFrequency ( );
+}
+
+// wakes the presenter to upload a new picture, or when it may be idle waiting for one.
+static void presenter_wake ( media_state_t *media_state )
+{
+	SDL_Event event  = { 0 };
+	event.type	   = FF_REFRESH_EVENT;
+	event.user.data1 = media_state;
+	SDL_PushEvent ( &event );
+}
+
+// lower bound of the bucket holding the requested percentile, in milliseconds.
+F64 stage_timer_percentile ( stage_timer_t *timer, F64 percentile )
+{
+	U64 wanted = ( U64 ) ( timer->count * percentile / 100.0 );
+	U64 seen   = 0;
+	
+	for ( S32 index = 0; index < STAGE_TIMER_BUCKETS; index++ )
+	{
+		seen += timer->buckets [ index ];
+		if ( seen > wanted )
+		{
+			U64 ns = index < 4 ? ( U64 ) index : ( ( U64 ) ( 4 + ( index & 3 ) ) << ( index / 4 - 2 ) );
+			return ns / 1e6;
+		}
+	}
+	
+	return timer->max / 1e6;
+}
+
+void occupancy_sample ( occupancy_t *occupancy, S32 value )
+{
+	occupancy->samples++;
+	occupancy->total += value;
+	occupancy->max    = FFMAX ( occupancy->max, value );
+}
+
+F64 peak_rss_megabytes ( void )
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS counters = { 0 };
+	
+	if ( K32GetProcessMemoryInfo ( GetCurrentProcess ( ), &counters, sizeof ( counters ) ) )
+	{
+		return counters.PeakWorkingSetSize / ( 1024.0 * 1024.0 );
+	}
+	
+	return 0;
+#else
+	struct rusage usage = { 0 };
+	
+	getrusage ( RUSAGE_SELF, &usage );
+	
+#ifdef __APPLE__
+	return usage.ru_maxrss / ( 1024.0 * 1024.0 );
+#else
+	return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+
+static S64 guess_correct_pts ( AVCodecContext *ctx, 
+							  S64 reordered_pts, 
+							  S64 dts )
+{
+	S64 pts = AV_NOPTS_VALUE;
+	
+    if ( dts != AV_NOPTS_VALUE )
+    {
+        ctx->pts_correction_num_faulty_dts += dts <= ctx->pts_correction_last_dts;
+        ctx->pts_correction_last_dts = dts;
+    }
+    else if ( reordered_pts != AV_NOPTS_VALUE )
+    {
+        ctx->pts_correction_last_dts = reordered_pts;
+    }
+	
+    if ( reordered_pts != AV_NOPTS_VALUE )
+    {
+        ctx->pts_correction_num_faulty_pts += reordered_pts <= ctx->pts_correction_last_pts;
+        ctx->pts_correction_last_pts = reordered_pts;
+    }
+    else if ( dts != AV_NOPTS_VALUE )
+    {
+        ctx->pts_correction_last_pts = dts;
+    }
+	
+    if ( ( ctx->pts_correction_num_faulty_pts <= ctx->pts_correction_num_faulty_dts || dts == AV_NOPTS_VALUE ) && reordered_pts != AV_NOPTS_VALUE )
+    {
+        pts = reordered_pts;
+    }
+    else
+    {
+        pts = dts;
+    }
+	
+    return pts;
+}
+
+
+F64 synchronize_video( media_state_t* media_state,
+					  AVFrame * src_frame,
+					  F64 pts )
+{
+	F64 frame_delay;
+	
+    if ( pts != 0 )
+    {
+        media_state->video_clock = pts;
+    }
+    else
+    {
+        pts = media_state->video_clock;
+    }
+	
+    frame_delay  = av_q2d ( media_state->video_codec_ctx->time_base );
+    frame_delay += src_frame->repeat_pict * ( frame_delay * 0.5 );
+    media_state->video_clock += frame_delay;
+	
+    return pts;
+}
+
+
+bool32 demux_needs_packets ( media_state_t *media_state )
+{
+	if ( SDL_AtomicGet ( &media_state->audio_queue.size ) + SDL_AtomicGet ( &media_state->video_queue.size ) > MAX_QUEUE_SIZE )
+	{
+		return false;
+	}
+	
+	if ( media_state->video_stream && SDL_AtomicGet ( &media_state->video_queue.duration ) < MAX_VIDEO_QUEUE_DURATION * 1000 )
+	{
+		return true;
+	}
+	
+	if ( media_state->audio_stream && SDL_AtomicGet ( &media_state->audio_queue.duration ) < MAX_AUDIO_QUEUE_DURATION * 1000 )
+	{
+		return true;
+	}
+	
+	return false;
+}
+
+
+static cache_block_t *read_cache_find ( read_cache_t *cache, S64 block )
+{
+	for ( S32 i = cache->map [ block & cache->map_mask ]; i >= 0; i = cache->blocks [ i ].next )
+	{
+		if ( cache->blocks [ i ].block == block )
+		{
+			return &cache->blocks [ i ];
+		}
+	}
+	
+	return 0;
+}
+
+static void read_cache_map_insert ( read_cache_t *cache, cache_block_t *slot, S64 block )
+{
+	S32 *head   = &cache->map [ block & cache->map_mask ];
+	slot->block = block;
+	slot->next  = *head;
+	*head       = ( S32 ) ( slot - cache->blocks );
+}
+
+static void read_cache_map_remove ( read_cache_t *cache, cache_block_t *slot )
+{
+	if ( slot->block < 0 )
+	{
+		return;
+	}
+	
+	S32 *link = &cache->map [ slot->block & cache->map_mask ];
+	
+	while ( *link != slot - cache->blocks )
+	{
+		link = &cache->blocks [ *link ].next;
+	}
+	
+	*link       = slot->next;
+	slot->block = -1;
+}
+
+// the next block the read-ahead thread should load, or -1. A block the
+// reader is blocked on always comes first.
+static S64 read_cache_next_block ( read_cache_t *cache )
+{
+	if ( cache->wanted_block >= 0 && !read_cache_find ( cache, cache->wanted_block ) )
+	{
+		return cache->wanted_block;
+	}
+	
+	S64 first = cache->position / CACHE_BLOCK_SIZE;
+	S64 ahead = cache->num_blocks * 3 / 4;
+	
+	// blocks inside the window are never evicted, so a scan picks up where
+	// the last one stopped.
+	for ( S64 block = FFMAX ( first, cache->filled_block ); block < first + ahead; block++ )
+	{
+		if ( cache->eof_block >= 0 && block >= cache->eof_block )
+		{
+			break;
+		}
+		
+		if ( !read_cache_find ( cache, block ) )
+		{
+			cache->filled_block = block;
+			return block;
+		}
+	}
+	
+	return -1;
+}
+
+// least recently used block outside the read-ahead window.
+static cache_block_t *read_cache_victim ( read_cache_t *cache )
+{
+	S64 first            = cache->position / CACHE_BLOCK_SIZE;
+	S64 ahead            = cache->num_blocks * 3 / 4;
+	cache_block_t *victim = 0;
+	
+	for ( S32 i = 0; i < cache->num_blocks; i++ )
+	{
+		cache_block_t *slot = &cache->blocks [ i ];
+		
+		if ( slot->block < 0 )
+		{
+			return slot;
+		}
+		
+		if ( slot->block >= first && slot->block < first + ahead )
+		{
+			continue;
+		}
+		
+		if ( !victim || slot->last_used < victim->last_used )
+		{
+			victim = slot;
+		}
+	}
+	
+	return victim;
+}
+
+int read_cache_thread ( void *arg )
+{
+	read_cache_t *cache = arg;
+	
+	log_thread_name ( "read-ahead" );
+	
+	SDL_LockMutex ( cache->mutex );
+	
+	while ( !cache->quit )
+	{
+		S64 block            = cache->error ? -1 : read_cache_next_block ( cache );
+		cache_block_t *slot  = block >= 0 ? read_cache_victim ( cache ) : 0;
+		
+		if ( !slot )
+		{
+			SDL_CondWait ( cache->wanted, cache->mutex );
+			continue;
+		}
+		
+		U8 *data             = cache->memory + ( S64 ) ( slot - cache->blocks ) * CACHE_BLOCK_SIZE;
+		cache->loading_block = block;
+		
+		read_cache_map_remove ( cache, slot );
+		
+		SDL_UnlockMutex ( cache->mutex );
+		
+		S32 length = 0;
+		S64 ret    = avio_seek ( cache->source, block * CACHE_BLOCK_SIZE, SEEK_SET );
+		
+		while ( ret >= 0 && length < CACHE_BLOCK_SIZE )
+		{
+			S32 n = avio_read ( cache->source, data + length, CACHE_BLOCK_SIZE - length );
+			if ( n <= 0 )
+			{
+				ret = n == AVERROR_EOF || n == 0 ? 0 : n;
+				break;
+			}
+			
+			length += n;
+		}
+		
+		SDL_LockMutex ( cache->mutex );
+		
+		cache->loading_block = -1;
+		
+		if ( ret < 0 )
+		{
+			cache->error = true;
+		}
+		else
+		{
+			read_cache_map_insert ( cache, slot, block );
+			slot->length     = length;
+			slot->last_used  = cache->clock;
+			cache->bytes_read += length;
+			
+			if ( length < CACHE_BLOCK_SIZE && ( cache->eof_block < 0 || block < cache->eof_block ) )
+			{
+				cache->eof_block = block + 1;
+				cache->file_size = block * CACHE_BLOCK_SIZE + length;
+			}
+		}
+		
+		SDL_CondBroadcast ( cache->block_ready );
+	}
+	
+	SDL_UnlockMutex ( cache->mutex );
+	
+	return 0;
+}
+
+static int read_cache_read ( void *opaque, U8 *buffer, int size )
+{
+	read_cache_t *cache = opaque;
+	S32 copied          = 0;
+	
+	SDL_LockMutex ( cache->mutex );
+	
+	S64 block            = cache->position / CACHE_BLOCK_SIZE;
+	cache_block_t *slot  = read_cache_find ( cache, block );
+	
+	if ( slot )
+	{
+		cache->hits++;
+	}
+	else
+	{
+		cache->misses++;
+		cache->wanted_block = block;
+		SDL_CondSignal ( cache->wanted );
+		
+		while ( !( slot = read_cache_find ( cache, block ) ) && !cache->error && !( cache->eof_block >= 0 && block >= cache->eof_block ) &&
+			   !( cache->interrupt && *cache->interrupt ) )
+		{
+			SDL_CondWaitTimeout ( cache->block_ready, cache->mutex, 10 );
+		}
+		
+		cache->wanted_block = -1;
+	}
+	
+	if ( slot )
+	{
+		S32 offset = ( S32 ) ( cache->position - block * CACHE_BLOCK_SIZE );
+		copied     = FFMIN ( size, slot->length - offset );
+		
+		if ( copied > 0 )
+		{
+			memcpy ( buffer, cache->memory + ( S64 ) ( slot - cache->blocks ) * CACHE_BLOCK_SIZE + offset, copied );
+			
+			slot->last_used      = ++cache->clock;
+			cache->position     += copied;
+			cache->bytes_served += copied;
+		}
+	}
+	
+	// wake the read-ahead thread: the window has moved.
+	SDL_CondSignal ( cache->wanted );
+	
+	bool32 error = cache->error;
+	
+	SDL_UnlockMutex ( cache->mutex );
+	
+	if ( copied > 0 )
+	{
+		return copied;
+	}
+	
+	return error ? AVERROR ( EIO ) : AVERROR_EOF;
+}
+
+static int64_t read_cache_seek ( void *opaque, int64_t offset, int whence )
+{
+	read_cache_t *cache = opaque;
+	S64 position        = -1;
+	
+	SDL_LockMutex ( cache->mutex );
+	
+	switch ( whence & ~AVSEEK_FORCE )
+	{
+		case AVSEEK_SIZE:
+		{
+			SDL_UnlockMutex ( cache->mutex );
+			return cache->file_size;
+		}
+		
+		case SEEK_SET:
+		{
+			position = offset;
+		} break;
+		
+		case SEEK_CUR:
+		{
+			position = cache->position + offset;
+		} break;
+		
+		case SEEK_END:
+		{
+			position = cache->file_size >= 0 ? cache->file_size + offset : -1;
+		} break;
+	}
+	
+	if ( position >= 0 )
+	{
+		// a seek back leaves the window, and what was filled with it.
+		if ( position < cache->position )
+		{
+			cache->filled_block = 0;
+		}
+		
+		cache->position = position;
+		SDL_CondSignal ( cache->wanted );
+	}
+	
+	SDL_UnlockMutex ( cache->mutex );
+	
+	return position >= 0 ? position : AVERROR ( EINVAL );
+}
+
+read_cache_t *read_cache_open ( const char *filename, S32 cache_mb, const bool32 *interrupt )
+{
+	read_cache_t *cache = av_mallocz ( sizeof ( read_cache_t ) );
+	
+	if ( !cache || avio_open2 ( &cache->source, filename, AVIO_FLAG_READ, 0, 0 ) < 0 )
+	{
+		fprintf ( stderr, "Read cache: could not open %s\n", filename );
+		av_free ( cache );
+		return 0;
+	}
+	
+	cache->num_blocks    = FFMAX ( cache_mb, MIN_CACHE_MB ) * ( 1024 * 1024 / CACHE_BLOCK_SIZE );
+	cache->memory        = av_malloc ( ( size_t ) cache->num_blocks * CACHE_BLOCK_SIZE );
+	cache->blocks        = av_malloc_array ( cache->num_blocks, sizeof ( cache_block_t ) );
+	cache->map_mask      = ( 2 << av_log2 ( cache->num_blocks ) ) - 1;
+	cache->map           = av_malloc_array ( cache->map_mask + 1, sizeof ( S32 ) );
+	cache->file_size     = avio_size ( cache->source );
+	cache->wanted_block  = -1;
+	cache->loading_block = -1;
+	cache->eof_block     = -1;
+	cache->interrupt     = interrupt;
+	cache->mutex         = SDL_CreateMutex ( );
+	cache->block_ready   = SDL_CreateCond  ( );
+	cache->wanted        = SDL_CreateCond  ( );
+	
+	U8 *buffer = av_malloc ( AVIO_BUFFER_SIZE );
+	
+	if ( !cache->memory || !cache->blocks || !cache->map || !buffer )
+	{
+		fprintf ( stderr, "Read cache: could not allocate %d MB\n", cache_mb );
+		av_free ( cache->memory );
+		av_free ( cache->blocks );
+		av_free ( cache->map );
+		av_free ( buffer );
+		avio_closep ( &cache->source );
+		av_free ( cache );
+		return 0;
+	}
+	
+	for ( S32 i = 0; i < cache->num_blocks; i++ )
+	{
+		cache->blocks [ i ].block = -1;
+	}
+	
+	for ( S32 i = 0; i <= cache->map_mask; i++ )
+	{
+		cache->map [ i ] = -1;
+	}
+	
+	cache->avio   = avio_alloc_context ( buffer, AVIO_BUFFER_SIZE, 0, cache, read_cache_read, 0, cache->file_size >= 0 ? read_cache_seek : 0 );
+	cache->thread = SDL_CreateThread ( read_cache_thread, "Read Ahead", cache );
+	
+	return cache;
+}
+
+// stops the read-ahead thread and frees the memory; the statistics stay.
+void read_cache_close ( read_cache_t *cache )
+{
+	if ( !cache || !cache->thread )
+	{
+		return;
+	}
+	
+	SDL_LockMutex   ( cache->mutex );
+	cache->quit = true;
+	SDL_CondSignal  ( cache->wanted );
+	SDL_UnlockMutex ( cache->mutex );
+	
+	SDL_WaitThread ( cache->thread, 0 );
+	cache->thread = 0;
+	
+	av_freep ( &cache->avio->buffer );
+	avio_context_free ( &cache->avio );
+	avio_closep ( &cache->source );
+	av_freep ( &cache->memory );
+	av_freep ( &cache->blocks );
+	av_freep ( &cache->map );
+}
+
+void read_cache_print_stats ( read_cache_t *cache )
+{
+	U64 reads = cache->hits + cache->misses;
+	
+	printf ( "Read cache:             %d MB, %.1f%% hit rate (%llu reads), %.1f MB read from source, %.1f MB served\n",
+			cache->num_blocks * ( CACHE_BLOCK_SIZE / 1024 ) / 1024,
+			reads ? 100.0 * cache->hits / reads : 0.0,
+			reads,
+			cache->bytes_read   / ( 1024.0 * 1024.0 ),
+			cache->bytes_served / ( 1024.0 * 1024.0 ) );
+}
+
+
+static bool32 file_identity ( const char *path, U64 *size, S64 *mtime )
+{
+#ifdef WIN32
+	struct _stat64 info;
+	
+	if ( _stat64 ( path, &info ) != 0 )
+	{
+		return false;
+	}
+#else
+	struct stat info;
+	
+	if ( stat ( path, &info ) != 0 )
+	{
+		return false;
+	}
+#endif
+	
+	*size  = ( U64 ) info.st_size;
+	*mtime = ( S64 ) info.st_mtime;
+	
+	return true;
+}
+
+static void keyframe_index_path ( char *path, S32 size, const char *filename )
+{
+	snprintf ( path, size, "%s.vpidx", filename );
+}
+
+// keeps the kernel reading ahead of the demuxer and lets it drop pages
+// already consumed, so a 200 GB file does not grow the resident set.
+// Called for every read and seek (mov seeks once per packet), so it only
+// acts once the position leaves the first half of the advised window.
+static void mapped_input_advise ( mapped_input_t *input )
+{
+#ifndef WIN32
+	S64 page  = sysconf ( _SC_PAGESIZE );
+	S64 start = input->position & ~( page - 1 );
+	
+	if ( input->position >= input->advised_start && input->position + MMAP_ADVISE_WINDOW / 2 < input->advised )
+	{
+		return;
+	}
+	
+	if ( start < input->size )
+	{
+		madvise ( input->data + start, FFMIN ( MMAP_ADVISE_WINDOW, input->size - start ), MADV_WILLNEED );
+	}
+	
+	// only the part of the prefix not dropped before; a seek back makes
+	// the pages behind it eligible again.
+	S64 consumed = FFMAX ( start - MMAP_ADVISE_WINDOW, 0 );
+	
+	if ( consumed > input->dropped )
+	{
+		madvise ( input->data + input->dropped, consumed - input->dropped, MADV_DONTNEED );
+	}
+	
+	input->dropped       = consumed;
+	input->advised_start = start;
+	input->advised       = start + MMAP_ADVISE_WINDOW;
+#endif
+}
+
+static void mapped_input_unmap ( U8 *data, S64 size )
+{
+#ifdef WIN32
+	UnmapViewOfFile ( data );
+#else
+	munmap ( data, size );
+#endif
+}
+
+static int mapped_input_read ( void *opaque, U8 *buffer, int size )
+{
+	mapped_input_t *input = opaque;
+	S64 length            = FFMIN ( ( S64 ) size, input->size - input->position );
+	
+	if ( length <= 0 )
+	{
+		return AVERROR_EOF;
+	}
+	
+	memcpy ( buffer, input->data + input->position, length );
+	input->position += length;
+	
+	mapped_input_advise ( input );
+	
+	return ( int ) length;
+}
+
+static int64_t mapped_input_seek ( void *opaque, int64_t offset, int whence )
+{
+	mapped_input_t *input = opaque;
+	S64 position          = -1;
+	
+	switch ( whence & ~AVSEEK_FORCE )
+	{
+		case AVSEEK_SIZE:
+		{
+			return input->size;
+		}
+		
+		case SEEK_SET:
+		{
+			position = offset;
+		} break;
+		
+		case SEEK_CUR:
+		{
+			position = input->position + offset;
+		} break;
+		
+		case SEEK_END:
+		{
+			position = input->size + offset;
+		} break;
+	}
+	
+	if ( position < 0 )
+	{
+		return AVERROR ( EINVAL );
+	}
+	
+	input->position = position;
+	
+	mapped_input_advise ( input );
+	
+	return position;
+}
+
+mapped_input_t *mapped_input_open ( const char *filename )
+{
+	mapped_input_t *input = av_mallocz ( sizeof ( mapped_input_t ) );
+	U64 size              = 0;
+	S64 mtime             = 0;
+	
+	if ( !input || !file_identity ( filename, &size, &mtime ) || size == 0 )
+	{
+		av_free ( input );
+		return 0;
+	}
+	
+#ifdef WIN32
+	HANDLE file = CreateFileA ( filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0 );
+	if ( file != INVALID_HANDLE_VALUE )
+	{
+		HANDLE mapping = CreateFileMappingA ( file, 0, PAGE_READONLY, 0, 0, 0 );
+		CloseHandle ( file );
+		
+		if ( mapping )
+		{
+			input->data = MapViewOfFile ( mapping, FILE_MAP_READ, 0, 0, 0 );
+			CloseHandle ( mapping );
+		}
+	}
+#else
+	S32 fd = open ( filename, O_RDONLY );
+	if ( fd >= 0 )
+	{
+		input->data = mmap ( 0, size, PROT_READ, MAP_SHARED, fd, 0 );
+		close ( fd );
+		
+		if ( input->data == MAP_FAILED )
+		{
+			input->data = 0;
+		}
+		else
+		{
+			madvise ( input->data, size, MADV_SEQUENTIAL );
+		}
+	}
+#endif
+	
+	U8 *buffer = input->data ? av_malloc ( AVIO_BUFFER_SIZE ) : 0;
+	
+	input->size    = ( S64 ) size;
+	input->advised = -1;
+	input->avio    = buffer ? avio_alloc_context ( buffer, AVIO_BUFFER_SIZE, 0, input, mapped_input_read, 0, mapped_input_seek ) : 0;
+	
+	if ( !input->avio )
+	{
+		fprintf ( stderr, "Could not map %s, reading it normally\n", filename );
+		
+		if ( input->data )
+		{
+			mapped_input_unmap ( input->data, input->size );
+		}
+		
+		av_free ( buffer );
+		av_free ( input );
+		return 0;
+	}
+	
+	// large reads (packet payloads) skip the avio buffer and land in the packet directly.
+	input->avio->direct = 1;
+	
+	mapped_input_advise ( input );
+	
+	return input;
+}
+
+void mapped_input_close ( mapped_input_t *input )
+{
+	if ( !input )
+	{
+		return;
+	}
+	
+	mapped_input_unmap ( input->data, input->size );
+	
+	av_freep ( &input->avio->buffer );
+	avio_context_free ( &input->avio );
+	av_free ( input );
+}
+
+
+// maps the sidecar read only, so a multi-million entry index of a 200 GB
+// recording costs one mmap at open time. Byte seeking formats use the
+// mapping as is; the others get its entries copied into the stream's index.
+bool32 keyframe_index_load ( keyframe_index_t *index, const char *filename, AVStream *stream, S32 stream_index )
+{
+	char path [ 1100 ];
+	U64  file_size  = 0;
+	S64  file_mtime = 0;
+	void *base      = 0;
+	U64  size       = 0;
+	
+	keyframe_index_path ( path, sizeof ( path ), filename );
+	
+	if ( !file_identity ( filename, &file_size, &file_mtime ) )
+	{
+		return false;
+	}
+	
+#ifdef WIN32
+	HANDLE file = CreateFileA ( path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+	if ( file == INVALID_HANDLE_VALUE )
+	{
+		return false;
+	}
+	
+	LARGE_INTEGER file_length = { 0 };
+	GetFileSizeEx ( file, &file_length );
+	size = ( U64 ) file_length.QuadPart;
+	
+	HANDLE mapping = size >= sizeof ( keyframe_index_header_t ) ? CreateFileMappingA ( file, 0, PAGE_READONLY, 0, 0, 0 ) : 0;
+	CloseHandle ( file );
+	
+	if ( !mapping )
+	{
+		return false;
+	}
+	
+	base = MapViewOfFile ( mapping, FILE_MAP_READ, 0, 0, 0 );
+	CloseHandle ( mapping );
+#else
+	S32 fd = open ( path, O_RDONLY );
+	if ( fd < 0 )
+	{
+		return false;
+	}
+	
+	struct stat info;
+	
+	if ( fstat ( fd, &info ) == 0 && info.st_size >= ( off_t ) sizeof ( keyframe_index_header_t ) )
+	{
+		size = ( U64 ) info.st_size;
+		base = mmap ( 0, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		
+		if ( base == MAP_FAILED )
+		{
+			base = 0;
+		}
+	}
+	
+	close ( fd );
+#endif
+	
+	if ( !base )
+	{
+		return false;
+	}
+	
+	const keyframe_index_header_t *header = base;
+	
+	if ( header->magic         != KEYFRAME_INDEX_MAGIC ||
+		header->version       != KEYFRAME_INDEX_VERSION ||
+		header->file_size     != file_size ||
+		header->file_mtime    != file_mtime ||
+		header->stream_index  != stream_index ||
+		header->time_base_num != stream->time_base.num ||
+		header->time_base_den != stream->time_base.den ||
+		size != sizeof ( keyframe_index_header_t ) + ( U64 ) header->count * sizeof ( keyframe_index_entry_t ) )
+	{
+		fprintf ( stderr, "Ignoring stale keyframe index %s\n", path );
+		
+#ifdef WIN32
+		UnmapViewOfFile ( base );
+#else
+		munmap ( base, size );
+#endif
+		return false;
+	}
+	
+	index->header      = header;
+	index->entries     = ( const keyframe_index_entry_t* ) ( header + 1 );
+	index->mapped_size = size;
+	
+	return true;
+}
+
+void keyframe_index_close ( keyframe_index_t *index )
+{
+	if ( index->header )
+	{
+#ifdef WIN32
+		UnmapViewOfFile ( ( void* ) index->header );
+#else
+		munmap ( ( void* ) index->header, index->mapped_size );
+#endif
+	}
+	
+	av_freep ( &index->building );
+	memset ( index, 0, sizeof ( keyframe_index_t ) );
+}
+
+void keyframe_index_add ( keyframe_index_t *index, S64 pts, S64 pos )
+{
+	if ( index->building_count > 0 && pts <= index->building [ index->building_count - 1 ].pts )
+	{
+		return;
+	}
+	
+	if ( index->building_count == index->building_capacity )
+	{
+		U32 capacity                     = FFMAX ( index->building_capacity * 2, 1024 );
+		keyframe_index_entry_t *building = av_realloc_array ( index->building, capacity, sizeof ( keyframe_index_entry_t ) );
+		
+		if ( !building )
+		{
+			index->build = false;
+			return;
+		}
+		
+		index->building          = building;
+		index->building_capacity = capacity;
+	}
+	
+	index->building [ index->building_count ].pts = pts;
+	index->building [ index->building_count ].pos = pos;
+	index->building_count++;
+}
+
+S32 keyframe_index_save ( keyframe_index_t *index, const char *filename, AVStream *stream, S32 stream_index )
+{
+	keyframe_index_header_t header = { 0 };
+	char path [ 1100 ];
+	
+	keyframe_index_path ( path, sizeof ( path ), filename );
+	
+	if ( !file_identity ( filename, &header.file_size, &header.file_mtime ) )
+	{
+		return -1;
+	}
+	
+	header.magic         = KEYFRAME_INDEX_MAGIC;
+	header.version       = KEYFRAME_INDEX_VERSION;
+	header.stream_index  = stream_index;
+	header.time_base_num = stream->time_base.num;
+	header.time_base_den = stream->time_base.den;
+	header.count         = index->building_count;
+	
+	FILE *file = fopen ( path, "wb" );
+	if ( !file )
+	{
+		fprintf ( stderr, "Could not write keyframe index %s\n", path );
+		return -1;
+	}
+	
+	S32 ok = fwrite ( &header, sizeof ( header ), 1, file ) == 1 &&
+		fwrite ( index->building, sizeof ( keyframe_index_entry_t ), index->building_count, file ) == index->building_count;
+	
+	if ( fclose ( file ) != 0 || !ok )
+	{
+		fprintf ( stderr, "Could not write keyframe index %s\n", path );
+		remove ( path );
+		return -1;
+	}
+	
+	printf ( "Keyframe index: %u keyframes written to %s\n", index->building_count, path );
+	
+	return 0;
+}
+
+// last keyframe at or before pts, or 0.
+const keyframe_index_entry_t *keyframe_index_find ( keyframe_index_t *index, S64 pts )
+{
+	if ( !index->header || index->header->count == 0 || pts < index->entries [ 0 ].pts )
+	{
+		return 0;
+	}
+	
+	U32 low  = 0;
+	U32 high = index->header->count - 1;
+	
+	while ( low < high )
+	{
+		U32 middle = low + ( high - low + 1 ) / 2;
+		
+		if ( index->entries [ middle ].pts <= pts )
+		{
+			low = middle;
+		}
+		else
+		{
+			high = middle - 1;
+		}
+	}
+	
+	return &index->entries [ low ];
+}
+
+// hooks a loaded index into the demuxer. Formats that resync on any byte
+// (MPEG-TS/PS) are seeked by byte position directly; the rest get the
+// entries as demuxer index entries, which their own seek code searches.
+void keyframe_index_attach ( keyframe_index_t *index, AVFormatContext *fmt_ctx, AVStream *stream )
+{
+	index->byte_seek = !( fmt_ctx->iformat->flags & AVFMT_NO_BYTE_SEEK ) && ( fmt_ctx->iformat->flags & AVFMT_TS_DISCONT );
+	
+	// mov and matroska with cues read packets from their own index; entries
+	// added without a size would shift or overwrite real samples.
+	if ( !index->byte_seek && avformat_index_get_entries_count ( stream ) > 0 )
+	{
+		printf ( "Keyframe index: not used, the %s demuxer has its own\n", fmt_ctx->iformat->name );
+		return;
+	}
+	
+	if ( !index->byte_seek )
+	{
+		for ( U32 i = 0; i < index->header->count; i++ )
+		{
+			av_add_index_entry ( stream, index->entries [ i ].pos, index->entries [ i ].pts, 0, 0, AVINDEX_KEYFRAME );
+		}
+	}
+	
+	printf ( "Keyframe index: %u keyframes, %s seeking\n", index->header->count, index->byte_seek ? "byte" : "timestamp" );
+}
+
+// --index: reads every packet of the file once, without decoding.
+S32 keyframe_index_build_file ( const char *filename )
+{
+	AVFormatContext *fmt_ctx = 0;
+	keyframe_index_t index   = { 0 };
+	AVPacket packet          = { 0 };
+	
+	if ( avformat_open_input ( &fmt_ctx, filename, 0, 0 ) != 0 || avformat_find_stream_info ( fmt_ctx, 0 ) < 0 )
+	{
+		fprintf ( stderr, "Couldn't open file: %s\n", filename );
+		return -1;
+	}
+	
+	S32 stream_index = av_find_best_stream ( fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, 0, 0 );
+	if ( stream_index < 0 )
+	{
+		fprintf ( stderr, "Could not find a video stream\n" );
+		avformat_close_input ( &fmt_ctx );
+		return -1;
+	}
+	
+	for ( U32 i = 0; i < fmt_ctx->nb_streams; i++ )
+	{
+		fmt_ctx->streams [ i ]->discard = i == stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+	}
+	
+	while ( av_read_frame ( fmt_ctx, &packet ) >= 0 )
+	{
+		if ( packet.stream_index == stream_index && ( packet.flags & AV_PKT_FLAG_KEY ) && packet.pos >= 0 && packet.pts != AV_NOPTS_VALUE )
+		{
+			keyframe_index_add ( &index, packet.pts, packet.pos );
+		}
+		
+		av_packet_unref ( &packet );
+	}
+	
+	S32 ret = keyframe_index_save ( &index, filename, fmt_ctx->streams [ stream_index ], stream_index );
+	
+	keyframe_index_close ( &index );
+	avformat_close_input ( &fmt_ctx );
+	
+	return ret;
+}
+
+
+// true when the container headers already describe every audio and video
+// stream well enough to open the decoders, so the stream info scan (which
+// decodes ahead into the file) can be skipped.
+static bool32 stream_info_known ( AVFormatContext *fmt_ctx )
+{
+	static const char *containers [ ] = { "mov,mp4,m4a,3gp,3g2,mj2", "matroska,webm" };
+	bool32 known                      = false;
+	
+	for ( S32 i = 0; i < sizeof ( containers ) / sizeof ( containers [ 0 ] ); i++ )
+	{
+		known |= !strcmp ( fmt_ctx->iformat->name, containers [ i ] );
+	}
+	
+	for ( S32 i = 0; known && i < fmt_ctx->nb_streams; i++ )
+	{
+		AVCodecParameters *codecpar = fmt_ctx->streams [ i ]->codecpar;
+		
+		if ( codecpar->codec_type == AVMEDIA_TYPE_VIDEO )
+		{
+			known = codecpar->codec_id != AV_CODEC_ID_NONE && codecpar->width > 0 && codecpar->height > 0;
+		}
+		else if ( codecpar->codec_type == AVMEDIA_TYPE_AUDIO )
+		{
+			known = codecpar->codec_id != AV_CODEC_ID_NONE && codecpar->sample_rate > 0 && codecpar->channels > 0;
+		}
+	}
+	
+	return known;
+}
+
+
+int codec_open_thread ( void *arg )
+{
+	codec_open_job_t *job = ( codec_open_job_t* ) arg;
+	
+	log_thread_name ( "codec open" );
+	
+	job->result = stream_component_open ( job->media_state, job->stream_index );
+	return job->result;
+}
+
+
+void media_input_close ( media_input_t *input )
+{
+	avformat_close_input ( &input->fmt_ctx );
+	mapped_input_close   ( input->mapped_input );
+	read_cache_close     ( input->read_cache );
+	av_freep ( &input->read_cache );
+	
+	input->mapped_input = 0;
+}
+
+
+// opens filename through the configured input path (mmap, read cache or
+// plain avio) and picks the first video and audio streams.
+static S32 media_input_open ( media_state_t *media_state, const char *filename, media_input_t *input )
+{
+	AVFormatContext *fmt_ctx = 0;
+	
+	memset ( input, 0, sizeof ( media_input_t ) );
+	
+	if ( media_state->options.mmap_input )
+	{
+		input->mapped_input = mapped_input_open ( filename );
+		
+		if ( input->mapped_input )
+		{
+			fmt_ctx         = avformat_alloc_context ( );
+			fmt_ctx->pb     = input->mapped_input->avio;
+			fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+		}
+	}
+	else if ( media_state->options.cache_mb > 0 )
+	{
+		input->read_cache = read_cache_open ( filename, media_state->options.cache_mb, &media_state->quit );
+		
+		if ( input->read_cache )
+		{
+			fmt_ctx         = avformat_alloc_context ( );
+			fmt_ctx->pb     = input->read_cache->avio;
+			fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+		}
+	}
+	
+	S64 probesize  = media_state->options.probesize;
+	S32 analyze_ms = media_state->options.analyze_ms;
+	
+	if ( media_state->options.fast_start )
+	{
+		probesize  = probesize  ? probesize  : FAST_START_PROBESIZE;
+		analyze_ms = analyze_ms ? analyze_ms : FAST_START_ANALYZE_MS;
+	}
+	
+	if ( probesize > 0 || analyze_ms > 0 )
+	{
+		fmt_ctx = fmt_ctx ? fmt_ctx : avformat_alloc_context ( );
+		
+		if ( probesize > 0 )
+		{
+			fmt_ctx->probesize = probesize;
+		}
+		
+		if ( analyze_ms > 0 )
+		{
+			fmt_ctx->max_analyze_duration = ( S64 ) analyze_ms * 1000;
+		}
+	}
+	
+	if ( avformat_open_input ( &fmt_ctx, filename, 0, 0 ) != 0 )
+	{
+		fprintf ( stderr, "Couldn't open file: %s\n", filename );
+		media_input_close ( input );
+		return -1;
+	}
+	
+	input->fmt_ctx = fmt_ctx;
+	
+	if ( !media_state->startup.input_opened )
+	{
+		media_state->startup.input_opened = presenter_now ( );
+	}
+	
+	if ( media_state->options.fast_start && stream_info_known ( fmt_ctx ) )
+	{
+		printf ( "Fast start: %s headers are complete, stream info scan skipped\n", fmt_ctx->iformat->name );
+	}
+	else if ( avformat_find_stream_info ( fmt_ctx, 0 ) < 0 )
+	{
+		fprintf ( stderr, "Couldn't find stream information %s\n", filename );
+		media_input_close ( input );
+		return -1; 
+	}
+	
+	if ( !media_state->startup.streams_probed )
+	{
+		media_state->startup.streams_probed = presenter_now ( );
+	}
+	
+	if ( !media_state->options.fast_start )
+	{
+		av_dump_format ( fmt_ctx, 0, filename, 0 );
+	}
+	
+	input->video_stream_index = -1;
+	input->audio_stream_index = -1;
+	
+	for ( int i = 0; i < fmt_ctx->nb_streams; i++ )
+	{
+		if ( fmt_ctx->streams [ i ]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && input->video_stream_index < 0 ) 
+		{
+			input->video_stream_index = i;
+		}
+		
+		if ( fmt_ctx->streams [ i ]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && input->audio_stream_index < 0 ) 
+		{
+			input->audio_stream_index = i;
+		}
+	}
+	
+	return 0;
+}
+
+// demux thread: keyframe index sidecar for the current input.
+static void keyframe_index_setup ( media_state_t *media_state )
+{
+	AVFormatContext *fmt_ctx = media_state->fmt_ctx;
+	U64 file_size            = 0;
+	S64 file_mtime           = 0;
+	
+	if ( keyframe_index_load ( &media_state->keyframe_index, media_state->filename, media_state->video_stream, media_state->video_stream_index ) )
+	{
+		keyframe_index_attach ( &media_state->keyframe_index, fmt_ctx, media_state->video_stream );
+	}
+	else if ( !( fmt_ctx->iformat->flags & AVFMT_NOFILE ) && file_identity ( media_state->filename, &file_size, &file_mtime ) )
+	{
+		// first playback of a large file: collect the index as a side effect,
+		// unless the demuxer already has one.
+		media_state->keyframe_index.build = file_size >= KEYFRAME_INDEX_MIN_FILE_SIZE && avformat_index_get_entries_count ( media_state->video_stream ) == 0;
+	}
+}
+
+
+static void playlist_boundary_free ( void *opaque, U8 *data )
+{
+	playlist_boundary_t *boundary = ( playlist_boundary_t* ) data;
+	
+	avcodec_parameters_free ( &boundary->codecpar );
+	av_free ( boundary );
+}
+
+static bool32 playlist_is_boundary ( AVPacket *packet )
+{
+	return packet->stream_index == PLAYLIST_BOUNDARY_STREAM && packet->buf;
+}
+
+// queues the marker that switches the consumer over to playlist item item.
+static void playlist_put_boundary ( packet_queue_t *queue, S32 item, AVCodecParameters *codecpar )
+{
+	playlist_boundary_t *boundary = av_mallocz ( sizeof ( playlist_boundary_t ) );
+	AVPacket packet               = { 0 };
+	
+	if ( !queue->packets || !boundary )
+	{
+		av_free ( boundary );
+		return;
+	}
+	
+	boundary->item     = item;
+	boundary->codecpar = avcodec_parameters_alloc ( );
+	avcodec_parameters_copy ( boundary->codecpar, codecpar );
+	
+	packet.buf          = av_buffer_create ( ( U8* ) boundary, sizeof ( playlist_boundary_t ), playlist_boundary_free, 0, 0 );
+	packet.data         = packet.buf->data;
+	packet.stream_index = PLAYLIST_BOUNDARY_STREAM;
+	packet.pts          = AV_NOPTS_VALUE;
+	packet.dts          = AV_NOPTS_VALUE;
+	
+	packet_queue_put ( queue, &packet );
+}
+
+// demux thread: moves a packet of the current item onto the playlist
+// timeline (the first item's time base, shifted past the earlier items).
+static void playlist_retime ( media_state_t *media_state, packet_queue_t *queue, AVPacket *packet )
+{
+	playlist_t *playlist = &media_state->playlist;
+	AVRational time_base = media_state->fmt_ctx->streams [ packet->stream_index ]->time_base;
+	S64 timestamp        = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+	
+	if ( timestamp != AV_NOPTS_VALUE )
+	{
+		playlist->end = FFMAX ( playlist->end, av_rescale_q ( timestamp + FFMAX ( packet->duration, 0 ), time_base, AV_TIME_BASE_Q ) + playlist->shift );
+	}
+	
+	if ( playlist->sequence == 0 )
+	{
+		return;
+	}
+	
+	S64 shift = av_rescale_q ( playlist->shift, AV_TIME_BASE_Q, queue->time_base );
+	
+	av_packet_rescale_ts ( packet, time_base, queue->time_base );
+	
+	if ( packet->pts != AV_NOPTS_VALUE )
+	{
+		packet->pts += shift;
+	}
+	
+	if ( packet->dts != AV_NOPTS_VALUE )
+	{
+		packet->dts += shift;
+	}
+}
+
+// demux thread: hands a packet of the current input to its queue.
+static void demux_route_packet ( media_state_t *media_state, AVPacket *packet )
+{
+	if ( media_state->keyframe_index.build && packet->stream_index == media_state->video_stream_index &&
+		( packet->flags & AV_PKT_FLAG_KEY ) && packet->pos >= 0 && packet->pts != AV_NOPTS_VALUE )
+	{
+		keyframe_index_add ( &media_state->keyframe_index, packet->pts, packet->pos );
+	}
+	
+	if ( packet->stream_index == media_state->video_stream_index )
+	{
+		playlist_retime  ( media_state, &media_state->video_queue, packet );
+		packet_queue_put ( &media_state->video_queue, packet );
+	}
+	else if ( packet->stream_index == media_state->audio_stream_index )
+	{
+		playlist_retime  ( media_state, &media_state->audio_queue, packet );
+		packet_queue_put ( &media_state->audio_queue, packet );
+	}
+	else
+	{
+		av_packet_unref ( packet );
+	}
+}
+
+
+// opens the next playlist item and reads its first packets, so the switch
+// at the end of the current item costs neither a probe nor a cold read.
+int playlist_prefetch_thread ( void *arg )
+{
+	media_state_t *media_state    = ( media_state_t* ) arg;
+	playlist_prefetch_t *prefetch = &media_state->playlist.prefetch;
+	S32 bytes                     = 0;
+	
+	log_thread_name ( "prefetch" );
+	
+	prefetch->num_packets = 0;
+	prefetch->result      = media_input_open ( media_state, media_state->playlist.items [ prefetch->position ], &prefetch->input );
+	
+	if ( prefetch->result < 0 )
+	{
+		return -1;
+	}
+	
+	while ( prefetch->num_packets < PLAYLIST_PREFETCH_PACKETS && bytes < PLAYLIST_PREFETCH_BYTES && !media_state->quit )
+	{
+		AVPacket *packet = prefetch->packets [ prefetch->num_packets ];
+		
+		if ( av_read_frame ( prefetch->input.fmt_ctx, packet ) < 0 )
+		{
+			break;
+		}
+		
+		if ( packet->stream_index != prefetch->input.video_stream_index && packet->stream_index != prefetch->input.audio_stream_index )
+		{
+			av_packet_unref ( packet );
+			continue;
+		}
+		
+		bytes += packet->size;
+		prefetch->num_packets++;
+	}
+	
+	return 0;
+}
+
+static void playlist_prefetch_start ( media_state_t *media_state, S32 position )
+{
+	playlist_t *playlist          = &media_state->playlist;
+	playlist_prefetch_t *prefetch = &playlist->prefetch;
+	
+	if ( position >= playlist->count )
+	{
+		if ( !playlist->loop )
+		{
+			return;
+		}
+		
+		position = 0;
+	}
+	
+	for ( S32 i = 0; i < PLAYLIST_PREFETCH_PACKETS && !prefetch->packets [ i ]; i++ )
+	{
+		prefetch->packets [ i ] = av_packet_alloc ( );
+		assert ( prefetch->packets [ i ] );
+	}
+	
+	prefetch->position = position;
+	prefetch->thread   = SDL_CreateThread ( playlist_prefetch_thread, "Playlist Prefetch", media_state );
+}
+
+// waits for the prefetch thread; drops its input unless keep is set.
+static void playlist_prefetch_finish ( media_state_t *media_state, bool32 keep )
+{
+	playlist_prefetch_t *prefetch = &media_state->playlist.prefetch;
+	
+	if ( prefetch->thread )
+	{
+		SDL_WaitThread ( prefetch->thread, 0 );
+		prefetch->thread = 0;
+	}
+	
+	if ( !keep )
+	{
+		for ( S32 i = 0; i < prefetch->num_packets; i++ )
+		{
+			av_packet_unref ( prefetch->packets [ i ] );
+		}
+		
+		prefetch->num_packets = 0;
+		media_input_close ( &prefetch->input );
+	}
+}
+
+// the pipeline keeps the first item's streams; an item has to bring the same ones.
+static bool32 playlist_item_compatible ( media_state_t *media_state, media_input_t *input )
+{
+	bool32 has_audio = input->audio_stream_index >= 0 && !media_state->options.no_audio;
+	
+	return input->video_stream_index >= 0 && has_audio == ( media_state->audio_stream != 0 );
+}
+
+// demux thread, at the end of the current item: switches to the prefetched
+// next item, queues the boundary markers and its pre-read packets, and
+// starts prefetching the item after it. Returns -1 at the end of the playlist.
+static S32 playlist_advance ( media_state_t *media_state )
+{
+	playlist_t *playlist          = &media_state->playlist;
+	playlist_prefetch_t *prefetch = &playlist->prefetch;
+	
+	for ( S32 skipped = 0; ; skipped++ )
+	{
+		if ( !prefetch->thread || skipped >= playlist->count || media_state->quit )
+		{
+			return -1;
+		}
+		
+		playlist_prefetch_finish ( media_state, true );
+		
+		if ( prefetch->result == 0 && playlist_item_compatible ( media_state, &prefetch->input ) )
+		{
+			break;
+		}
+		
+		fprintf ( stderr, "Skipping %s: it could not be opened or its streams differ from the first item\n", playlist->items [ prefetch->position ] );
+		
+		playlist_prefetch_finish ( media_state, false );
+		playlist_prefetch_start  ( media_state, prefetch->position + 1 );
+	}
+	
+	media_input_t previous = { media_state->fmt_ctx, media_state->read_cache, media_state->mapped_input };
+	media_input_t *input   = &prefetch->input;
+	AVFormatContext *fmt_ctx = input->fmt_ctx;
+	S64 start_time           = fmt_ctx->start_time != AV_NOPTS_VALUE ? fmt_ctx->start_time : 0;
+	
+	keyframe_index_close ( &media_state->keyframe_index );
+	memset ( &media_state->keyframe_index, 0, sizeof ( keyframe_index_t ) );
+	
+	media_state->fmt_ctx            = fmt_ctx;
+	media_state->read_cache         = input->read_cache;
+	media_state->mapped_input       = input->mapped_input;
+	media_state->video_stream_index = input->video_stream_index;
+	media_state->video_stream       = fmt_ctx->streams [ input->video_stream_index ];
+	
+	if ( media_state->audio_stream )
+	{
+		media_state->audio_stream_index = input->audio_stream_index;
+		media_state->audio_stream       = fmt_ctx->streams [ input->audio_stream_index ];
+	}
+	
+	playlist->position = prefetch->position;
+	playlist->sequence++;
+	playlist->shift    = playlist->end - start_time;
+	playlist->start    = ( F64 ) playlist->end / AV_TIME_BASE;
+	playlist->duration = fmt_ctx->duration != AV_NOPTS_VALUE ? ( F64 ) fmt_ctx->duration / AV_TIME_BASE : 0;
+	
+	av_strlcpy ( media_state->filename, playlist->items [ playlist->position ], sizeof ( media_state->filename ) );
+	
+	LOG_EVENT ( LOG_DEBUG, LOG_EVENT_PLAYLIST_ITEM, playlist->position, playlist->sequence, playlist->start, prefetch->num_packets, 0, 0 );
+	
+	playlist_put_boundary ( &media_state->video_queue, playlist->sequence, media_state->video_stream->codecpar );
+	
+	if ( media_state->audio_stream )
+	{
+		playlist_put_boundary ( &media_state->audio_queue, playlist->sequence, media_state->audio_stream->codecpar );
+	}
+	
+	for ( S32 i = 0; i < prefetch->num_packets; i++ )
+	{
+		demux_route_packet ( media_state, prefetch->packets [ i ] );
+	}
+	
+	prefetch->num_packets = 0;
+	memset ( input, 0, sizeof ( media_input_t ) );
+	
+	keyframe_index_setup ( media_state );
+	
+	media_input_close ( &previous );
+	
+	playlist_prefetch_start ( media_state, playlist->position + 1 );
+	
+	return 0;
+}
+
+
+// demux thread: performs a seek requested through stream_seek.
+static void stream_do_seek ( media_state_t *media_state )
+{
+	// seek_pos is on the playlist timeline, the demuxer wants the current item's own timestamps.
+	S64 target = media_state->seek_pos - media_state->playlist.shift;
+	S64 minimum = media_state->seek_increment > 0 ? target - media_state->seek_increment + 2 : INT64_MIN;
+	S64 maximum = media_state->seek_increment < 0 ? target - media_state->seek_increment - 2 : INT64_MAX;
+	
+	keyframe_index_t *index              = &media_state->keyframe_index;
+	const keyframe_index_entry_t *entry  = 0;
+	S32 ret                              = -1;
+	
+	// a partial index from an interrupted first pass is not worth saving.
+	index->build = false;
+	
+	if ( index->byte_seek )
+	{
+		entry = keyframe_index_find ( index, av_rescale_q ( target, AV_TIME_BASE_Q, media_state->video_stream->time_base ) );
+	}
+	
+	if ( entry )
+	{
+		ret = avformat_seek_file ( media_state->fmt_ctx, -1, entry->pos, entry->pos, entry->pos, AVSEEK_FLAG_BYTE );
+	}
+	else
+	{
+		ret = avformat_seek_file ( media_state->fmt_ctx, -1, minimum, target, maximum, 0 );
+	}
+	
+	if ( ret < 0 )
+	{
+		fprintf ( stderr, "%s: error while seeking to %.3f\n", media_state->filename, ( F64 ) target / AV_TIME_BASE );
+		media_state->seek_requested_at = 0;
+	}
+	else
+	{
+		media_state->seek_target = ( F64 ) media_state->seek_pos / AV_TIME_BASE;
+		
+		packet_queue_flush ( &media_state->video_queue );
+		packet_queue_flush ( &media_state->audio_queue );
+		
+		// the flush may have dropped the marker for the item being demuxed.
+		if ( media_state->playlist.sequence > 0 )
+		{
+			playlist_put_boundary ( &media_state->video_queue, media_state->playlist.sequence, media_state->video_stream->codecpar );
+			
+			if ( media_state->audio_stream )
+			{
+				playlist_put_boundary ( &media_state->audio_queue, media_state->playlist.sequence, media_state->audio_stream->codecpar );
+			}
+		}
+		
+		media_state->seek_serial = SDL_AtomicGet ( &media_state->video_queue.serial );
+	}
+	
+	SDL_AtomicSet ( &media_state->seek_request, false );
+}
+
+int decode_thread ( void *arg )
+{
+	media_state_t *media_state = ( media_state_t* ) arg;
+	media_input_t input        = { 0 };
+	AVPacket packet            = { 0 };
+	S32 ret                    = -1;
+	
+	log_thread_name ( "demux" );
+	
+	if ( media_input_open ( media_state, media_state->filename, &input ) < 0 )
+	{
+		goto failure;
+	}
+	
+	AVFormatContext *fmt_ctx = input.fmt_ctx;
+	
+	media_state->video_stream_index = -1;
+	media_state->audio_stream_index = -1;
+	
+	S32 video_stream_index = input.video_stream_index;
+	S32 audio_stream_index = input.audio_stream_index;
+	
+	
+	media_state->fmt_ctx      = fmt_ctx;
+	media_state->read_cache   = input.read_cache;
+	media_state->mapped_input = input.mapped_input;
+	
+	
+	if ( video_stream_index == -1 )
+	{
+		fprintf ( stderr, "Could not find a video stream\n" );
+		goto failure;
+	}
+	
+	codec_open_job_t audio_open   = { media_state, audio_stream_index, 0 };
+	SDL_Thread *audio_open_thread = 0;
+	
+	if ( audio_stream_index == -1 )
+	{
+		fprintf ( stderr, "Couldn't find a audio stream\n" );
+	}
+	else if ( !media_state->options.no_audio && media_state->options.fast_start )
+	{
+		// the audio decoder and device open while this thread opens the video decoder.
+		audio_open_thread = SDL_CreateThread ( codec_open_thread, "Audio Codec Open", &audio_open );
+	}
+	
+	S32 video_open_result = stream_component_open ( media_state, video_stream_index );
+	
+	if ( audio_open_thread )
+	{
+		SDL_WaitThread ( audio_open_thread, 0 );
+	}
+	else if ( audio_stream_index != -1 && !media_state->options.no_audio && video_open_result >= 0 )
+	{
+		audio_open.result = stream_component_open ( media_state, audio_stream_index );
+	}
+	
+	if ( video_open_result < 0 )
+	{
+		printf ( "Could not open video codec\n" );
+		goto failure;
+	}
+	
+	if ( audio_open.result < 0 )
+	{
+		printf ( "Could not open audio codec\n" );
+		goto failure;
+	}
+	
+	media_state->startup.codecs_opened = presenter_now ( );
+	
+    if ( media_state->video_stream_index < 0 )
+    {
+        printf ( "Could not open codecs: %s\n", media_state->filename );
+        goto failure;
+    }
+	
+	keyframe_index_setup ( media_state );
+	
+	media_state->playlist.duration = fmt_ctx->duration != AV_NOPTS_VALUE ? ( F64 ) fmt_ctx->duration / AV_TIME_BASE : 0;
+	
+	if ( media_state->playlist.count > 1 || media_state->playlist.loop )
+	{
+		playlist_prefetch_start ( media_state, 1 );
+	}
+	
+	
+    for ( ; ; )
+    {
+        if ( media_state->quit )
+        {
+            break;
+        }
+		
+        if ( SDL_AtomicGet ( &media_state->seek_request ) )
+        {
+            stream_do_seek ( media_state );
+        }
+		
+        if ( !demux_needs_packets ( media_state ) )
+        {
+            wait_point_enter ( &media_state->demux_space );
+			
+            while ( !demux_needs_packets ( media_state ) && !media_state->quit && !SDL_AtomicGet ( &media_state->seek_request ) )
+            {
+                SDL_CondWait ( media_state->demux_space.condition, media_state->demux_space.mutex );
+            }
+			
+            wait_point_leave ( &media_state->demux_space );
+            continue;
+        }
+		
+        U64 demux_start = stage_timer_start ( );
+		
+        ret =  av_read_frame ( media_state->fmt_ctx, &packet );
+		
+		stage_timer_stop ( &media_state->stats.demux, demux_start );
+		
+		trace_span ( TRACE_DEMUX, demux_start,
+					ret < 0 || packet.pts == AV_NOPTS_VALUE ? TRACE_NO_PTS : packet.pts * av_q2d ( media_state->fmt_ctx->streams [ packet.stream_index ]->time_base ) );
+		
+		if ( ret < 0 )
+        {
+			if ( ret == AVERROR_EOF )
+            {
+                if ( media_state->keyframe_index.build )
+                {
+                    keyframe_index_save ( &media_state->keyframe_index, media_state->filename, media_state->video_stream, media_state->video_stream_index );
+                    media_state->keyframe_index.build = false;
+                }
+				
+                if ( playlist_advance ( media_state ) == 0 )
+                {
+                    continue;
+                }
+				
+                packet_queue_set_eof ( &media_state->video_queue );
+                packet_queue_set_eof ( &media_state->audio_queue );
+				
+                // stay alive at the end of the file so it can still be seeked.
+                wait_point_enter ( &media_state->demux_space );
+				
+                while ( !media_state->quit && !SDL_AtomicGet ( &media_state->seek_request ) )
+                {
+                    SDL_CondWait ( media_state->demux_space.condition, media_state->demux_space.mutex );
+                }
+				
+                wait_point_leave ( &media_state->demux_space );
+                continue;
+            }
+			
+            if ( media_state->fmt_ctx->pb->error == 0 )
+            {
+                wait_point_enter ( &media_state->demux_space );
+                SDL_CondWaitTimeout ( media_state->demux_space.condition, media_state->demux_space.mutex, 10 );
+                wait_point_leave ( &media_state->demux_space );
+                continue;
+            }
+            else
+            {
+                break;
+            }
+        }
+		
+        demux_route_packet ( media_state, &packet );
+    }
+	
+    wait_point_enter ( &media_state->demux_space );
+	
+    while ( !media_state->quit )
+    {
+        SDL_CondWait ( media_state->demux_space.condition, media_state->demux_space.mutex );
+    }
+	
+    wait_point_leave ( &media_state->demux_space );
+	
+	playlist_prefetch_finish ( media_state, false );
+	
+	keyframe_index_close ( &media_state->keyframe_index );
+	avformat_close_input ( &media_state->fmt_ctx );
+	read_cache_close     ( media_state->read_cache );
+	mapped_input_close   ( media_state->mapped_input );
+	media_state->mapped_input = 0;
+	
+	
+	failure:
+    {
+        if ( 1 )
+        {
+            SDL_Event event;
+            event.type = FF_QUIT_EVENT;
+            event.user.data1 = media_state;
+            SDL_PushEvent ( &event );
+            return -1;
+        }
+    }
+	
+    return 0;
+}
+
+
+AVCodecContext *playlist_switch_decoder ( media_state_t *media_state, AVCodecContext *codec_ctx, AVCodecParameters *codecpar );
+
+int video_thread ( void *arg )
+{
+    media_state_t *media_state = ( media_state_t* ) arg;
+    bool32 frame_finished = false;
+	bool32 drained        = false;
+	S32 ret               = -1;
+	S32 serial            = 0;
+	S32 item              = 0;
+	F64 pts               =  0;
+	
+	log_thread_name ( "video" );
+	
+	AVPacket *packet = av_packet_alloc ( );
+    if ( !packet )
+    {
+        fprintf ( stderr, "Could not alloc packet\n" );
+        return -1;
+    }
+	
+	AVFrame *frame = av_frame_alloc ( );
+    if ( !frame )
+    {
+        fprintf ( stderr, "Could not allocate AVFrame\n" );
+        return -1;
+    }
+	
+    for ( ; ; )
+    {
+		AVPacket *send_packet   = packet;
+		S32       packet_serial = serial;
+		U64       wait_start    = TRACE_NOW ( );
+		
+		playlist_boundary_t *boundary = 0;
+		
+        if ( packet_queue_get ( &media_state->video_queue, packet, 1, &packet_serial ) < 0 )
+        {
+            if ( media_state->quit || !SDL_AtomicGet ( &media_state->video_queue.eof ) )
+            {
+                break;
+            }
+			
+			// end of stream: drain the decoder once, then idle until a seek.
+			if ( drained )
+			{
+				SDL_AtomicSet ( &media_state->video_finished, true );
+				presenter_wake ( media_state );
+				
+				if ( packet_queue_wait ( &media_state->video_queue ) < 0 )
+				{
+					break;
+				}
+				
+				continue;
+			}
+			
+			send_packet = 0;
+        }
+		else
+		{
+			if ( packet_serial != serial )
+			{
+				avcodec_flush_buffers ( media_state->video_codec_ctx );
+				
+				serial                   = packet_serial;
+				drained                  = false;
+				media_state->video_clock = 0;
+				SDL_AtomicSet ( &media_state->video_finished, false );
+			}
+			
+			if ( playlist_is_boundary ( packet ) )
+			{
+				boundary = ( playlist_boundary_t* ) packet->data;
+				
+				if ( boundary->item == item )
+				{
+					av_packet_unref ( packet );
+					continue;
+				}
+				
+				// next playlist item: first drain the frames the decoder still holds.
+				send_packet = 0;
+			}
+		}
+		
+		trace_span ( TRACE_PACKET_WAIT, wait_start, TRACE_NO_PTS );
+		
+		pts = 0;
+		
+		U64 decode_start = stage_timer_start ( );
+		U64 decode_ticks = 0;
+		
+        int ret = avcodec_send_packet ( media_state->video_codec_ctx, send_packet );
+		
+		decode_ticks += SDL_GetPerformanceCounter ( ) - decode_start;
+		trace_span ( TRACE_SEND_PACKET, decode_start, TRACE_NO_PTS );
+		
+        if ( ret < 0 )
+		{
+            fprintf ( stderr, "Error sending packet for decoding\n" );
+            return -1;
+        }
+		
+		if ( send_packet )
+		{
+			media_state->frame_drop.packets++;
+		}
+		
+        while ( ret >= 0 )
+        {
+			decode_start = SDL_GetPerformanceCounter ( );
+			
+            ret = avcodec_receive_frame ( media_state->video_codec_ctx, frame );
+			
+			decode_ticks += SDL_GetPerformanceCounter ( ) - decode_start;
+			
+            if ( ret == AVERROR ( EAGAIN ) || ret == AVERROR_EOF )
+            {
+                break;
+            }
+            else if ( ret < 0 )
+            {
+                fprintf ( stderr, "Error while decoding\n" );
+                return -1;
+            }
+            else
+            {
+                frame_finished = true;
+				media_state->frame_drop.decoded++;
+            }
+			
+            pts = guess_correct_pts ( media_state->video_codec_ctx, frame->pts, frame->pkt_dts);
+			
+            if ( pts == AV_NOPTS_VALUE )
+            {
+                pts = 0;
+            }
+			
+            pts *= av_q2d ( media_state->video_queue.time_base );
+			
+			// --accurate-seek: decode through to the requested position instead
+			// of showing the keyframe the demuxer landed on.
+			if ( media_state->options.accurate_seek && serial > 0 && pts + media_state->frame_last_delay / 2 < media_state->seek_target )
+			{
+				av_frame_unref ( frame );
+				continue;
+			}
+			
+            if ( frame_finished )
+            {
+				pts = synchronize_video ( media_state, frame, pts );
+				trace_span ( TRACE_RECEIVE_FRAME, decode_start, pts );
+				
+                if ( queue_picture ( media_state, frame, pts, serial ) < 0 )
+                {
+                    break;
+                }
+            }
+        }
+		
+		stage_timer_stop ( &media_state->stats.video_decode, SDL_GetPerformanceCounter ( ) - decode_ticks );
+		
+		if ( boundary )
+		{
+			media_state->video_codec_ctx = playlist_switch_decoder ( media_state, media_state->video_codec_ctx, boundary->codecpar );
+			item                         = boundary->item;
+		}
+		
+        av_packet_unref ( packet );
+		
+		if ( !send_packet && !boundary )
+		{
+			drained = true;
+		}
+    }
+	
+    av_frame_free ( &frame );
+    av_free       (  frame );
+	
+    SDL_AtomicSet ( &media_state->video_finished, true );
+	presenter_wake ( media_state );
+	
+    return 0;
+}
+
+
+
+F64 get_audio_clock ( media_state_t* media_state )
+{
+	F64 pts                  = media_state->audio_write_clock;
+    F32 hardware_buffer_size = pcm_ring_fill ( &media_state->audio_ring ) + media_state->audio_hardware_buffer_size;
+    F32 bytes_per_second     = 0;
+    S32 n                    = 2 * media_state->audio_out_channels;
+	
+    if ( media_state->audio_stream )
+    {
+        bytes_per_second = media_state->audio_out_sample_rate * n;
+    }
+	
+    if ( bytes_per_second )
+    {
+        pts -= ( F64 ) hardware_buffer_size / bytes_per_second;
+    }
+	
+    return pts;
+}
+
+
+int audio_thread ( void *arg )
+{
+	media_state_t *media_state = ( media_state_t* ) arg;
+	S32 audio_size             = -1;
+	F64 pts                    = 0;
+	
+	log_thread_name ( "audio" );
+	
+	for ( ; ; )
+	{
+		audio_size = audio_decode_frame ( media_state, 
+										 media_state->audio_buffer, sizeof ( media_state->audio_buffer ), &pts );
+		if ( audio_size < 0 )
+		{
+			if ( media_state->quit || !SDL_AtomicGet ( &media_state->audio_queue.eof ) )
+			{
+				break;
+			}
+			
+			// end of stream: idle until a seek queues audio again.
+			SDL_AtomicSet ( &media_state->audio_ring.finished, true );
+			
+			if ( packet_queue_wait ( &media_state->audio_queue ) < 0 )
+			{
+				break;
+			}
+			
+			SDL_AtomicSet ( &media_state->audio_ring.finished, false );
+			continue;
+		}
+		
+		U64 wait_start = TRACE_NOW ( );
+		
+		if ( !media_state->options.bench && pcm_ring_write ( &media_state->audio_ring, media_state->audio_buffer, audio_size ) < 0 )
+		{
+			break;
+		}
+		
+		trace_span ( TRACE_AUDIO_RING_WAIT, wait_start, pts );
+		
+		media_state->audio_write_clock = media_state->audio_clock;
+	}
+	
+	SDL_AtomicSet ( &media_state->audio_ring.finished, true );
+	
+	return 0;
+}
+
+
+void audio_callback ( void * userdata, U8 *stream, S32 length )
+{
+	media_state_t *media_state = ( media_state_t* ) userdata;
+	pcm_ring_t    *ring        = &media_state->audio_ring;
+	U64 callback_start         = TRACE_NOW ( );
+	
+	if ( logger.trace && !SDL_TLSGet ( logger.tls ) )
+	{
+		log_thread_name ( "audio device" );
+	}
+	
+	U32 copied = pcm_ring_read ( ring, stream, length );
+	
+	if ( copied > 0 && !media_state->startup.first_audio )
+	{
+		media_state->startup.first_audio = presenter_now ( );
+	}
+	
+	if ( copied < ( U32 ) length )
+	{
+		memset ( stream + copied, 0, length - copied );
+		
+		if ( SDL_AtomicGet ( &ring->primed ) && !SDL_AtomicGet ( &ring->finished ) && !media_state->quit )
+		{
+			SDL_AtomicAdd ( &ring->underruns,      1 );
+			SDL_AtomicAdd ( &ring->underrun_bytes, length - copied );
+		}
+	}
+	
+	trace_span ( TRACE_AUDIO_CALLBACK, callback_start, TRACE_NO_PTS );
+}
+
+
+// thread_count / thread_type of 0 mean "auto": use every threading mode the
+// codec supports, with a thread count that grows with the picture size and
+// never exceeds the core count.
+void configure_decoder_threads ( AVCodecContext *codec_ctx, const AVCodec *codec, player_options_t *options )
+{
+	S32 cores        = SDL_GetCPUCount ( );
+	S32 thread_count = options->decoder_threads;
+	S32 thread_type  = options->decoder_thread_type;
+	
+	if ( thread_type == 0 )
+	{
+		if ( codec->capabilities & AV_CODEC_CAP_FRAME_THREADS )
+		{
+			thread_type |= FF_THREAD_FRAME;
+		}
+		
+		if ( codec->capabilities & AV_CODEC_CAP_SLICE_THREADS )
+		{
+			thread_type |= FF_THREAD_SLICE;
+		}
+	}
+	
+	if ( thread_count == 0 )
+	{
+		S64 pixels = ( S64 ) codec_ctx->width * codec_ctx->height;
+		
+		if ( pixels <= 1280 * 720 )
+		{
+			thread_count = 4;
+		}
+		else if ( pixels <= 1920 * 1088 )
+		{
+			thread_count = 8;
+		}
+		else if ( pixels <= 4096 * 2304 )
+		{
+			thread_count = 16;
+		}
+		else
+		{
+			thread_count = 32;
+		}
+		
+		// frame threads each add a frame of latency and hold their own
+		// references. libavcodec picks frame threading whenever it is
+		// allowed, so the cap applies even when slice threading is too.
+		if ( thread_type & FF_THREAD_FRAME )
+		{
+			thread_count = FFMIN ( thread_count, 16 );
+		}
+		
+		// leave a core for demuxing, conversion and presentation; players
+		// sharing the process split the remaining cores.
+		thread_count = FFMAX ( FFMIN ( thread_count, ( cores > 4 ? cores - 1 : cores ) / FFMAX ( options->num_players, 1 ) ), 1 );
+	}
+	
+	codec_ctx->thread_count = thread_count;
+	codec_ctx->thread_type  = thread_type;
+}
+
+
+// finds, configures and opens the decoder for codecpar.
+static int picture_pool_get_buffer ( AVCodecContext *codec_ctx, AVFrame *frame, int flags );
+
+AVCodecContext *decoder_open ( AVCodecParameters *codecpar, media_state_t *media_state )
+{
+	player_options_t *options = &media_state->options;
+	
+	const AVCodec *codec = avcodec_find_decoder ( codecpar->codec_id );
+	if ( !codec )
+    {
+        printf ( "Unsupported codec\n" );
+        return 0;
+    }
+	
+    AVCodecContext *codec_ctx = avcodec_alloc_context3 ( codec );
+    if ( avcodec_parameters_to_context ( codec_ctx, codecpar ) < 0 )
+    {
+        printf ( "Could not copy codec context\n" );
+        avcodec_free_context ( &codec_ctx );
+        return 0;
+    }
+	
+	if ( codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO )
+	{
+		configure_decoder_threads ( codec_ctx, codec, options );
+		
+		if ( options->huge_pages && ( codec->capabilities & AV_CODEC_CAP_DR1 ) )
+		{
+			codec_ctx->opaque      = media_state;
+			codec_ctx->get_buffer2 = picture_pool_get_buffer;
+#if LIBAVCODEC_VERSION_MAJOR < 59
+			codec_ctx->thread_safe_callbacks = 1;
+#endif
+		}
+	}
+	
+    if ( avcodec_open2 ( codec_ctx, codec, 0 ) < 0 )
+    {
+		printf ( "Unsupported codec!\n" );
+        avcodec_free_context ( &codec_ctx );
+		return 0;
+	}
+	
+	return codec_ctx;
+}
+
+// at a playlist boundary, once the old item's frames have been drained: a
+// decoder whose parameters match the next item only needs a flush, anything
+// else gets a new one.
+AVCodecContext *playlist_switch_decoder ( media_state_t *media_state, AVCodecContext *codec_ctx, AVCodecParameters *codecpar )
+{
+	bool32 reusable = codec_ctx->codec_id == codecpar->codec_id &&
+		codec_ctx->extradata_size == codecpar->extradata_size &&
+		( codecpar->extradata_size == 0 || !memcmp ( codec_ctx->extradata, codecpar->extradata, codecpar->extradata_size ) );
+	
+	if ( codecpar->codec_type == AVMEDIA_TYPE_VIDEO )
+	{
+		reusable = reusable && codec_ctx->width == codecpar->width && codec_ctx->height == codecpar->height;
+	}
+	else
+	{
+		reusable = reusable && codec_ctx->sample_rate == codecpar->sample_rate && codec_ctx->channels == codecpar->channels;
+	}
+	
+	if ( reusable )
+	{
+		avcodec_flush_buffers ( codec_ctx );
+		SDL_AtomicAdd ( &media_state->playlist.decoders_reused, 1 );
+		return codec_ctx;
+	}
+	
+	AVCodecContext *next = decoder_open ( codecpar, media_state );
+	if ( !next )
+	{
+		// keep the old decoder; the item decodes as well as it can.
+		avcodec_flush_buffers ( codec_ctx );
+		return codec_ctx;
+	}
+	
+	avcodec_free_context ( &codec_ctx );
+	SDL_AtomicAdd ( &media_state->playlist.decoders_opened, 1 );
+	
+	return next;
+}
+
+
+void video_open ( media_state_t *media_state );
+
+int stream_component_open ( media_state_t *media_state, S32 stream_index )
+{
+	
+    AVFormatContext *fmt_ctx = media_state->fmt_ctx;
+	S32 ret = -1;
+	
+    if ( stream_index < 0 || stream_index >= fmt_ctx->nb_streams )
+    {
+        printf ( "Invalid stream index\n" );
+        return -1;
+    }
+	
+	
+    AVCodecContext *codec_ctx = decoder_open ( fmt_ctx->streams [ stream_index ]->codecpar, media_state );
+    if ( !codec_ctx )
+    {
+        return -1;
+    }
+	
+    if ( codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO && media_state->options.bench )
+    {
+		media_state->audio_out_sample_rate = codec_ctx->sample_rate;
+		media_state->audio_out_channels    = FFMIN ( codec_ctx->channels, 8 );
+    }
+    else if ( codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO )
+    {
+        SDL_AudioSpec wanted_specs = { 0 };
+        SDL_AudioSpec specs        = { 0 };
+		
+        wanted_specs.freq     = codec_ctx->sample_rate;
+        wanted_specs.format   = AUDIO_S16SYS;
+        wanted_specs.channels = codec_ctx->channels;
+        wanted_specs.silence  = 0;
+        wanted_specs.samples  = SDL_AUDIO_BUFFER_SIZE;
+        wanted_specs.callback = audio_callback;
+        wanted_specs.userdata = media_state;
+		
+        
+		// a device per player; the resampler absorbs a rate or channel count the device picks.
+		media_state->audio_device = SDL_OpenAudioDevice ( 0, 0, &wanted_specs, &specs, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE );
+		if ( !media_state->audio_device )
+        {
+            fprintf ( stderr, "SDL_OpenAudioDevice: %s\n", SDL_GetError ( ) );
+            return -1;
+        }
+		
+		media_state->audio_out_sample_rate      = specs.freq;
+		media_state->audio_out_channels         = specs.channels;
+		media_state->audio_hardware_buffer_size = specs.size;
+		
+		pcm_ring_init ( &media_state->audio_ring,
+					   ( U32 ) ( ( S64 ) media_state->options.audio_ring_ms * specs.freq / 1000 ) * specs.channels * 2 );
+    }
+	
+	if ( codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO )
+	{
+		printf ( "Video decoder: %s %dx%d, %d threads, %s threading\n",
+				codec_ctx->codec->name,
+				codec_ctx->width,
+				codec_ctx->height,
+				codec_ctx->thread_count,
+				codec_ctx->active_thread_type == FF_THREAD_FRAME ? "frame" :
+				codec_ctx->active_thread_type == FF_THREAD_SLICE ? "slice" : "no" );
+	}
+	
+	switch ( codec_ctx->codec_type )
+	{
+		case AVMEDIA_TYPE_AUDIO:
+		{
+			media_state->audio_stream_index = stream_index;
+			media_state->audio_stream       = fmt_ctx->streams [ stream_index ];
+			media_state->audio_codec_ctx    = codec_ctx;
+			
+			// kept for the life of the stream, audio_decode_frame runs once per callback.
+			media_state->audio_packet = av_packet_alloc ( );
+			media_state->audio_frame  = av_frame_alloc  ( );
+			if ( !media_state->audio_packet || !media_state->audio_frame )
+			{
+				fprintf ( stderr, "Could not allocate the audio packet and frame\n" );
+				return -1;
+			}
+			
+			packet_queue_init ( &media_state->audio_queue, media_state->audio_stream, &media_state->demux_space, &media_state->quit, &media_state->seek_request );
+			
+			media_state->audio_thread_id = SDL_CreateThread ( audio_thread, "Audio Thread", media_state );
+			
+			if ( !media_state->options.bench )
+			{
+				SDL_PauseAudioDevice ( media_state->audio_device, 0 );
+			}
+			
+		} break;
+		
+		case AVMEDIA_TYPE_VIDEO:
+		{
+			media_state->video_stream_index  = stream_index;
+			media_state->video_stream        = fmt_ctx->streams [ stream_index ];
+			media_state->video_codec_ctx     = codec_ctx;
+			
+			
+            media_state->frame_timer      = presenter_now ( );
+			media_state->frame_last_delay = 40e-3;
+			
+			packet_queue_init ( &media_state->video_queue, media_state->video_stream, &media_state->demux_space, &media_state->quit, &media_state->seek_request );
+			
+            media_state->screen_mutex = SDL_CreateMutex ( );
+			
+			media_state->video_thread_id = SDL_CreateThread ( video_thread, "Video Thread", media_state );
+			
+			if ( media_state->options.bench )
+			{
+				video_open ( media_state );
+			}
+			else
+			{
+				SDL_Event event  = { 0 };
+				event.type       = FF_VIDEO_OPEN_EVENT;
+				event.user.data1 = media_state;
+				SDL_PushEvent ( &event );
+			}
+			
+		} break;
+		
+        default:
+        {
+        } break;
+    }
+	
+    return 0;
+}
+
+
+static void frame_drop_set_stage ( media_state_t *media_state, S32 stage )
+{
+	AVCodecContext *codec_ctx = media_state->video_codec_ctx;
+	
+	media_state->frame_drop.stage = stage;
+	
+	codec_ctx->skip_frame       = stage >= 1 ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+	codec_ctx->skip_loop_filter = stage >= 2 ? AVDISCARD_ALL    : AVDISCARD_DEFAULT;
+	
+	printf ( "Frame drop stage %d: skip_frame %s, skip_loop_filter %s\n",
+			stage,
+			stage >= 1 ? "nonref" : "default",
+			stage >= 2 ? "all"    : "default" );
+}
+
+// runs on the video thread for every decoded picture, before any conversion.
+// A picture is late when the audio clock has already passed it by more than a
+// frame. Each FRAME_DROP_WINDOW pictures the stage moves up if more than a
+// quarter were late, and back down if none were.
+bool32 frame_drop_check ( media_state_t *media_state, F64 pts )
+{
+	frame_drop_state_t *drop = &media_state->frame_drop;
+	bool32 late              = false;
+	
+	if ( media_state->audio_stream && SDL_AtomicGet ( &media_state->audio_ring.primed ) )
+	{
+		F64 lateness  = get_audio_clock ( media_state ) - pts;
+		F64 threshold = FFMAX ( media_state->frame_last_delay, AV_SYNC_THRESHOLD );
+		
+		late = lateness > threshold && lateness < AV_NOSYNC_THRESHOLD;
+	}
+	
+	drop->window_frames++;
+	drop->window_late += late;
+	
+	if ( drop->window_frames >= FRAME_DROP_WINDOW )
+	{
+		if ( drop->window_late * 4 > drop->window_frames && drop->stage < 2 )
+		{
+			frame_drop_set_stage ( media_state, drop->stage + 1 );
+		}
+		else if ( drop->window_late == 0 && drop->stage > 0 )
+		{
+			frame_drop_set_stage ( media_state, drop->stage - 1 );
+		}
+		
+		drop->window_frames = 0;
+		drop->window_late   = 0;
+	}
+	
+	if ( late )
+	{
+		drop->dropped++;
+	}
+	
+	return late;
+}
+
+
+// --huge-pages: whole picture buffers in 2 MB pages. MAP_HUGETLB needs
+// reserved pages, otherwise transparent huge pages are requested.
+static void picture_pool_unmap ( void *opaque, U8 *data )
+{
+#ifdef WIN32
+	VirtualFree ( data, 0, MEM_RELEASE );
+#else
+	munmap ( data, ( size_t ) opaque );
+#endif
+}
+
+static AVBufferRef *picture_pool_alloc ( void *opaque, int size )
+{
+	picture_pool_t *pool   = ( picture_pool_t* ) opaque;
+	AVBufferRef    *buffer = 0;
+	
+	SDL_AtomicAdd ( &pool->allocated, 1 );
+	
+	if ( pool->huge_pages )
+	{
+#ifdef WIN32
+		// large pages need SeLockMemoryPrivilege; without it this falls through.
+		size_t page   = GetLargePageMinimum ( );
+		size_t mapped = page ? FFALIGN ( ( size_t ) size, page ) : 0;
+		U8    *data   = mapped ? VirtualAlloc ( 0, mapped, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE ) : 0;
+#else
+		size_t mapped = FFALIGN ( ( size_t ) size, HUGE_PAGE_SIZE );
+		U8    *data   = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		data = mmap ( 0, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+#endif
+		if ( data == MAP_FAILED )
+		{
+			data = mmap ( 0, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+#ifdef MADV_HUGEPAGE
+			if ( data != MAP_FAILED )
+			{
+				madvise ( data, mapped, MADV_HUGEPAGE );
+			}
+#endif
+		}
+		
+		data = data != MAP_FAILED ? data : 0;
+#endif
+		if ( data )
+		{
+			buffer = av_buffer_create ( data, size, picture_pool_unmap, ( void* ) mapped, 0 );
+			if ( !buffer )
+			{
+				picture_pool_unmap ( ( void* ) mapped, data );
+			}
+			
+			return buffer;
+		}
+	}
+	
+	// av_malloc aligns to the widest SIMD the build supports.
+	return av_buffer_alloc ( size );
+}
+
+// a new format or size drops the old pool; buffers still held by pictures
+// are freed when their last reference goes.
+static S32 picture_pool_configure ( picture_pool_t *pool, enum AVPixelFormat format, S32 width, S32 height )
+{
+	if ( pool->pool && pool->format == format && pool->width == width && pool->height == height )
+	{
+		return 0;
+	}
+	
+	av_buffer_pool_uninit ( &pool->pool );
+	
+	S32 ret = av_image_fill_linesizes ( pool->linesizes, format, width );
+	if ( ret < 0 )
+	{
+		return ret;
+	}
+	
+	for ( S32 i = 0; i < 4; i++ )
+	{
+		pool->linesizes [ i ] = FFALIGN ( pool->linesizes [ i ], PICTURE_ALIGN );
+	}
+	
+	U8 *planes [ 4 ];
+	
+	pool->size = av_image_fill_pointers ( planes, format, height, 0, pool->linesizes );
+	if ( pool->size < 0 )
+	{
+		return pool->size;
+	}
+	
+	// decoders may read and write a little past the last plane.
+	pool->pool = av_buffer_pool_init2 ( pool->size + 16 + PICTURE_ALIGN, pool, picture_pool_alloc, 0 );
+	if ( !pool->pool )
+	{
+		return AVERROR ( ENOMEM );
+	}
+	
+	pool->format = format;
+	pool->width  = width;
+	pool->height = height;
+	pool->reconfigured++;
+	
+	return 0;
+}
+
+// picture must be unreferenced.
+static S32 picture_pool_get ( picture_pool_t *pool, AVFrame *picture, enum AVPixelFormat format, S32 width, S32 height )
+{
+	S32 ret = picture_pool_configure ( pool, format, width, height );
+	if ( ret < 0 )
+	{
+		return ret;
+	}
+	
+	picture->buf [ 0 ] = av_buffer_pool_get ( pool->pool );
+	if ( !picture->buf [ 0 ] )
+	{
+		return AVERROR ( ENOMEM );
+	}
+	
+	picture->format = format;
+	picture->width  = width;
+	picture->height = height;
+	
+	memcpy ( picture->linesize, pool->linesizes, sizeof ( pool->linesizes ) );
+	av_image_fill_pointers ( picture->data, format, height, picture->buf [ 0 ]->data, pool->linesizes );
+	
+	return 0;
+}
+
+// get_buffer2 with --huge-pages: decoded pictures, which playback uploads
+// as they are, come from the decoder pool. Anything the pool cannot lay out
+// the way the decoder needs goes to the default allocator.
+static int picture_pool_get_buffer ( AVCodecContext *codec_ctx, AVFrame *frame, int flags )
+{
+	media_state_t            *media_state = codec_ctx->opaque;
+	picture_pool_t           *pool        = &media_state->decoder_pool;
+	const AVPixFmtDescriptor *desc        = av_pix_fmt_desc_get ( frame->format );
+	S32 linesize_align [ AV_NUM_DATA_POINTERS ];
+	S32 frame_width  = frame->width;
+	S32 frame_height = frame->height;
+	S32 width        = frame->width;
+	S32 height       = frame->height;
+	
+	if ( !desc || ( desc->flags & ( AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL ) ) )
+	{
+		return avcodec_default_get_buffer2 ( codec_ctx, frame, flags );
+	}
+	
+	avcodec_align_dimensions2 ( codec_ctx, &width, &height, linesize_align );
+	
+	for ( S32 i = 0; i < 4; i++ )
+	{
+		if ( linesize_align [ i ] > PICTURE_ALIGN )
+		{
+			return avcodec_default_get_buffer2 ( codec_ctx, frame, flags );
+		}
+	}
+	
+	SDL_LockMutex   ( pool->mutex );
+	S32 ret = picture_pool_get ( pool, frame, frame->format, width, height );
+	SDL_UnlockMutex ( pool->mutex );
+	
+	// the padded size was only for the layout; the decoder's own size,
+	// cropping still to come, is what the frame keeps.
+	frame->width         = frame_width;
+	frame->height        = frame_height;
+	frame->extended_data = frame->data;
+	
+	return ret;
+}
+
+
+int queue_picture ( media_state_t *media_state, AVFrame *frame, F64 pts, S32 serial )
+{
+	U64 wait_start = TRACE_NOW ( );
+	
+    SDL_LockMutex ( media_state->picture_queue_mutex );
+	
+    while ( ( media_state->picture_queue_size >= media_state->picture_queue_capacity || !media_state->video_output_ready ) && !media_state->quit )
+    {
+        SDL_CondWait ( media_state->picture_queue_condition, media_state->picture_queue_mutex );
+    }
+	
+    SDL_UnlockMutex ( media_state->picture_queue_mutex );
+	
+	trace_span ( TRACE_PICTURE_WAIT, wait_start, pts );
+	
+    if ( media_state->quit )
+    {
+        return -1;
+    }
+	
+	if ( serial != SDL_AtomicGet ( &media_state->video_queue.serial ) || frame_drop_check ( media_state, pts ) )
+	{
+		av_frame_unref ( frame );
+		return 0;
+	}
+	
+    video_picture_t *video_picture = &media_state->picture_queue [ media_state->picture_queue_write_index ];
+	AVFrame         *picture       = video_picture->frame;
+	
+	// playback hands the decoded frame over as is, the presenter converts
+	// it straight into the texture. The null sink converts here instead.
+	if ( frame->format == media_state->output_pix_fmt || !media_state->options.bench )
+	{
+		av_frame_unref     ( picture );
+		av_frame_move_ref  ( picture, frame );
+	}
+	else
+	{
+		av_frame_unref ( picture );
+		
+		if ( picture_pool_get ( &media_state->picture_pool, picture, media_state->output_pix_fmt, frame->width, frame->height ) < 0 )
+		{
+			fprintf ( stderr, "Could not allocate picture\n" );
+			return -1;
+		}
+		
+		if ( sliced_scaler_configure ( &media_state->video_scaler,
+									  frame->width, frame->height, frame->format,
+									  frame->width, frame->height, media_state->output_pix_fmt,
+									  SWS_BILINEAR, media_state->workers->num_threads + 1 ) < 0 )
+		{
+			fprintf ( stderr, "Could not initialize the conversion context\n" );
+			return -1;
+		}
+		
+		U64 convert_start = stage_timer_start ( );
+		
+		sliced_scaler_scale ( &media_state->video_scaler,
+							 media_state->workers,
+							 ( const U8** ) frame->data,
+							 frame->linesize,
+							 picture->data,
+							 picture->linesize );
+		
+		stage_timer_stop ( &media_state->stats.video_convert, convert_start );
+		trace_span ( TRACE_CONVERT, convert_start, pts );
+		
+		av_frame_copy_props ( picture, frame );
+	}
+	
+	video_picture->pts    = pts;
+	video_picture->serial = serial;
+	
+	++media_state->picture_queue_write_index;
+	
+	if ( media_state->picture_queue_write_index == media_state->picture_queue_capacity )
+	{
+		media_state->picture_queue_write_index = 0;
+	}
+	
+	SDL_LockMutex   ( media_state->picture_queue_mutex );
+	bool32 was_empty = media_state->picture_queue_size++ == 0;
+	SDL_UnlockMutex ( media_state->picture_queue_mutex );
+	
+	// every picture, so it is uploaded ahead of its time.
+	if ( was_empty || !media_state->options.bench )
+	{
+		presenter_wake ( media_state );
+	}
+	
+    return 0;
+}
+
+static const struct
+{
+	enum AVPixelFormat pix_fmt;
+	U32                texture_format;
+	
+} texture_format_map [ ] =
+{
+	{ AV_PIX_FMT_YUV420P, SDL_PIXELFORMAT_IYUV     },
+	{ AV_PIX_FMT_YUYV422, SDL_PIXELFORMAT_YUY2     },
+	{ AV_PIX_FMT_UYVY422, SDL_PIXELFORMAT_UYVY     },
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+	{ AV_PIX_FMT_NV12,    SDL_PIXELFORMAT_NV12     },
+	{ AV_PIX_FMT_NV21,    SDL_PIXELFORMAT_NV21     },
+#endif
+	{ AV_PIX_FMT_RGB32,   SDL_PIXELFORMAT_ARGB8888 },
+	{ AV_PIX_FMT_BGR32,   SDL_PIXELFORMAT_ABGR8888 },
+	{ AV_PIX_FMT_RGB24,   SDL_PIXELFORMAT_RGB24    },
+	{ AV_PIX_FMT_BGR24,   SDL_PIXELFORMAT_BGR24    },
+};
+
+
+static U32 texture_format_for ( enum AVPixelFormat pix_fmt, SDL_RendererInfo *info )
+{
+	for ( S32 i = 0; i < sizeof ( texture_format_map ) / sizeof ( texture_format_map [ 0 ] ); i++ )
+	{
+		if ( texture_format_map [ i ].pix_fmt != pix_fmt )
+		{
+			continue;
+		}
+		
+		for ( U32 j = 0; j < info->num_texture_formats; j++ )
+		{
+			if ( info->texture_formats [ j ] == texture_format_map [ i ].texture_format )
+			{
+				return texture_format_map [ i ].texture_format;
+			}
+		}
+	}
+	
+	return SDL_PIXELFORMAT_UNKNOWN;
+}
+
+
+static const char *pix_fmt_name ( enum AVPixelFormat pix_fmt )
+{
+	const char *name = av_get_pix_fmt_name ( pix_fmt );
+	
+	// unknown until the first decoded frame when the stream info scan was skipped.
+	return name ? name : "unknown";
+}
+
+
+// pixel layout of a window surface, as the scaler names it.
+static enum AVPixelFormat surface_format_for ( U32 surface_format )
+{
+	switch ( surface_format )
+	{
+		case SDL_PIXELFORMAT_ARGB8888:
+		case SDL_PIXELFORMAT_RGB888:   return AV_PIX_FMT_RGB32;
+		case SDL_PIXELFORMAT_ABGR8888:
+		case SDL_PIXELFORMAT_BGR888:   return AV_PIX_FMT_BGR32;
+		case SDL_PIXELFORMAT_RGB565:   return AV_PIX_FMT_RGB565;
+		case SDL_PIXELFORMAT_RGB24:    return AV_PIX_FMT_RGB24;
+		case SDL_PIXELFORMAT_BGR24:    return AV_PIX_FMT_BGR24;
+	}
+	
+	return AV_PIX_FMT_NONE;
+}
+
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
+typedef const U8 * ( APIENTRY *gl_get_string_t ) ( U32 name );
+
+// a machine without a GPU ends up with SDL's software renderer, with no
+// accelerated renderer at all, or with GL on a software rasteriser.
+static bool32 renderer_is_software ( SDL_Renderer *renderer, SDL_RendererInfo *info )
+{
+	if ( !renderer || ( info->flags & SDL_RENDERER_SOFTWARE ) )
+	{
+		return true;
+	}
+	
+	// the renderer's context is current on this thread.
+	if ( info->name && !strncmp ( info->name, "opengl", 6 ) )
+	{
+		gl_get_string_t gl_get_string = ( gl_get_string_t ) SDL_GL_GetProcAddress ( "glGetString" );
+		const char     *name          = gl_get_string ? ( const char* ) gl_get_string ( GL_RENDERER_NAME ) : 0;
+		
+		if ( name && ( strstr ( name, "llvmpipe" ) || strstr ( name, "softpipe" ) || strstr ( name, "Software Rasterizer" ) ) )
+		{
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+
+// creates the window and its renderer. With --fast-start main calls this
+// before the input is probed, so driver and GL context setup overlap probing.
+// Players sharing the main loop present without vsync: each blocking present
+// would wait for its own vblank and divide the refresh rate between them.
+// Their presenters pace by the clock instead.
+void video_open_window ( media_state_t *media_state, S32 width, S32 height )
+{
+	bool32 vsync = media_state->options.num_players <= 1;
+	
+	if ( !media_state->screen )
+	{
+		media_state->screen = SDL_CreateWindow ( "5433D R32433 <saeed@rezaee.net>",
+												 SDL_WINDOWPOS_UNDEFINED,
+												 SDL_WINDOWPOS_UNDEFINED,
+												 width,
+												 height,
+												 SDL_WINDOW_OPENGL | SDL_WINDOW_ALLOW_HIGHDPI );
+		
+		SDL_GL_SetSwapInterval ( vsync ? 1 : 0 );
+	}
+	
+	if ( media_state->screen && !media_state->renderer )
+	{
+		media_state->renderer = SDL_CreateRenderer ( media_state->screen, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE | ( vsync ? SDL_RENDERER_PRESENTVSYNC : 0 ) );
+	}
+	
+	if ( media_state->screen && !media_state->startup.window_ready )
+	{
+		media_state->startup.window_ready = presenter_now ( );
+	}
+}
+
+
+// runs on the main thread once the video codec is open: creates the window
+// and renderer, then picks the texture format so that decoder output the
+// renderer can take natively is uploaded as is.
+void video_open ( media_state_t *media_state )
+{
+	AVCodecContext  *codec_ctx = media_state->video_codec_ctx;
+	SDL_RendererInfo info      = { 0 };
+	
+	if ( media_state->options.bench )
+	{
+		media_state->output_pix_fmt = AV_PIX_FMT_YUV420P;
+		
+		printf ( "Video output: null sink, decoder %s -> %s (%s)\n",
+				pix_fmt_name ( codec_ctx->pix_fmt ),
+				av_get_pix_fmt_name ( media_state->output_pix_fmt ),
+				media_state->output_pix_fmt == codec_ctx->pix_fmt ? "direct" : "sws_scale" );
+		
+		SDL_LockMutex   ( media_state->picture_queue_mutex );
+		media_state->video_output_ready = true;
+		SDL_CondSignal  ( media_state->picture_queue_condition );
+		SDL_UnlockMutex ( media_state->picture_queue_mutex );
+		return;
+	}
+	
+	S32 window_width  = codec_ctx->width;
+	S32 window_height = codec_ctx->height;
+	
+	if ( window_width > 1280 || window_height > 720 )
+	{
+		window_width  /= 2;
+		window_height /= 2;
+	}
+	
+	if ( !media_state->screen )
+	{
+		video_open_window ( media_state, window_width, window_height );
+	}
+	else if ( media_state->options.fast_start )
+	{
+		// created early at a placeholder size while the input was probed.
+		SDL_SetWindowSize ( media_state->screen, window_width, window_height );
+	}
+	
+	if ( !media_state->screen )
+	{
+		fprintf ( stderr, "SDL: could not create window - exiting\n" );
+		
+		SDL_Event event;
+		event.type       = FF_QUIT_EVENT;
+		event.user.data1 = media_state;
+		SDL_PushEvent ( &event );
+		return;
+	}
+	
+	SDL_GetRendererInfo ( media_state->renderer, &info );
+	
+	SDL_DisplayMode mode = { 0 };
+	
+	if ( SDL_GetCurrentDisplayMode ( SDL_GetWindowDisplayIndex ( media_state->screen ), &mode ) < 0 || mode.refresh_rate <= 0 )
+	{
+		mode.refresh_rate = DEFAULT_REFRESH_RATE;
+	}
+	
+	media_state->presenter.refresh_interval = 1.0 / mode.refresh_rate;
+	media_state->presenter.vsync            = ( info.flags & SDL_RENDERER_PRESENTVSYNC ) != 0;
+	
+	// without a GPU SDL would convert YUV and scale the whole picture again
+	// on every present; frames go straight to the window surface instead.
+	U32                surface_format = SDL_GetWindowPixelFormat ( media_state->screen );
+	enum AVPixelFormat surface_pix_fmt = surface_format_for ( surface_format );
+	
+	if ( renderer_is_software ( media_state->renderer, &info ) && surface_pix_fmt != AV_PIX_FMT_NONE )
+	{
+		if ( media_state->renderer )
+		{
+			SDL_DestroyRenderer ( media_state->renderer );
+			media_state->renderer = 0;
+		}
+		
+		// otherwise SDL backs the window surface with a texture on the
+		// accelerated renderer, GL on llvmpipe here, and every update is
+		// uploaded and drawn by the software rasteriser again.
+		SDL_SetHint ( SDL_HINT_FRAMEBUFFER_ACCELERATION, "0" );
+		
+#if SDL_VERSION_ATLEAST(2, 28, 0)
+		// SDL's own software renderer already created one.
+		SDL_DestroyWindowSurface ( media_state->screen );
+#endif
+		
+		media_state->software_output = true;
+		media_state->output_pix_fmt  = surface_pix_fmt;
+		media_state->presenter.vsync = false;
+		
+		printf ( "Video output: no GPU renderer (%s), decoder %s -> window surface %s (sliced sws_scale at window size)\n",
+				info.name ? info.name : "none",
+				pix_fmt_name ( codec_ctx->pix_fmt ),
+				SDL_GetPixelFormatName ( surface_format ) );
+		
+		SDL_LockMutex   ( media_state->picture_queue_mutex );
+		media_state->video_output_ready = true;
+		SDL_CondSignal  ( media_state->picture_queue_condition );
+		SDL_UnlockMutex ( media_state->picture_queue_mutex );
+		return;
+	}
+	
+	media_state->output_pix_fmt = codec_ctx->pix_fmt;
+	media_state->texture_format = texture_format_for ( codec_ctx->pix_fmt, &info );
+	
+	if ( media_state->texture_format == SDL_PIXELFORMAT_UNKNOWN )
+	{
+		media_state->output_pix_fmt = AV_PIX_FMT_YUV420P;
+		media_state->texture_format = texture_format_for ( AV_PIX_FMT_YUV420P, &info );
+		
+		for ( S32 i = 0; i < sizeof ( texture_format_map ) / sizeof ( texture_format_map [ 0 ] ) && media_state->texture_format == SDL_PIXELFORMAT_UNKNOWN; i++ )
+		{
+			media_state->output_pix_fmt = texture_format_map [ i ].pix_fmt;
+			media_state->texture_format = texture_format_for ( texture_format_map [ i ].pix_fmt, &info );
+		}
+	}
+	
+	if ( media_state->texture_format == SDL_PIXELFORMAT_UNKNOWN )
+	{
+		media_state->output_pix_fmt = AV_PIX_FMT_YUV420P;
+		media_state->texture_format = SDL_PIXELFORMAT_YV12;
+	}
+	
+	printf ( "Video output: renderer %s, decoder %s -> texture %s (%s)\n",
+			info.name,
+			pix_fmt_name ( codec_ctx->pix_fmt ),
+			SDL_GetPixelFormatName ( media_state->texture_format ),
+			media_state->output_pix_fmt == codec_ctx->pix_fmt ? "direct upload" : "sws_scale" );
+	
+	SDL_LockMutex   ( media_state->picture_queue_mutex );
+	media_state->video_output_ready = true;
+	SDL_CondSignal  ( media_state->picture_queue_condition );
+	SDL_UnlockMutex ( media_state->picture_queue_mutex );
+}
+
+
+// where SDL expects each plane of a locked streaming texture: planar YUV
+// follows the luma plane at half pitch, NV12/NV21 chroma at full pitch.
+static void texture_planes ( U32 texture_format, U8 *pixels, S32 pitch, S32 height, U8 *planes [ 4 ], S32 pitches [ 4 ] )
+{
+	memset ( planes,  0, 4 * sizeof ( U8* ) );
+	memset ( pitches, 0, 4 * sizeof ( S32 ) );
+	
+	planes  [ 0 ] = pixels;
+	pitches [ 0 ] = pitch;
+	
+	switch ( texture_format )
+	{
+		case SDL_PIXELFORMAT_IYUV:
+		case SDL_PIXELFORMAT_YV12:
+		{
+			S32 chroma_pitch  = ( pitch  + 1 ) / 2;
+			U8 *first         = pixels + pitch * height;
+			U8 *second        = first  + chroma_pitch * ( ( height + 1 ) / 2 );
+			bool32 swapped    = texture_format == SDL_PIXELFORMAT_YV12;
+			
+			planes  [ 1 ] = swapped ? second : first;
+			planes  [ 2 ] = swapped ? first  : second;
+			pitches [ 1 ] = chroma_pitch;
+			pitches [ 2 ] = chroma_pitch;
+		} break;
+		
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+		case SDL_PIXELFORMAT_NV12:
+		case SDL_PIXELFORMAT_NV21:
+		{
+			planes  [ 1 ] = pixels + pitch * height;
+			pitches [ 1 ] = 2 * ( ( pitch + 1 ) / 2 );
+		} break;
+#endif
+	}
+}
+
+// writes the decoded frame straight into the locked texture: a plane copy
+// when the texture takes the decoder format, otherwise the sliced scaler
+// converts into it. Either way the frame is copied once.
+static S32 upload_picture ( media_state_t *media_state, SDL_Texture *texture, AVFrame *frame )
+{
+	U8  *pixels = 0;
+	S32  pitch  = 0;
+	
+	if ( SDL_LockTexture ( texture, 0, ( void** ) &pixels, &pitch ) < 0 )
+	{
+		fprintf ( stderr, "SDL_LockTexture Error: %s\n", SDL_GetError ( ) );
+		return -1;
+	}
+	
+	U8 *planes  [ 4 ];
+	S32 pitches [ 4 ];
+	
+	texture_planes ( media_state->texture_format, pixels, pitch, frame->height, planes, pitches );
+	
+	if ( frame->format == media_state->output_pix_fmt )
+	{
+		av_image_copy ( planes, pitches, ( const U8** ) frame->data, frame->linesize, frame->format, frame->width, frame->height );
+	}
+	else if ( sliced_scaler_configure ( &media_state->video_scaler,
+									   frame->width, frame->height, frame->format,
+									   frame->width, frame->height, media_state->output_pix_fmt,
+									   SWS_BILINEAR, media_state->workers->num_threads + 1 ) < 0 )
+	{
+		fprintf ( stderr, "Could not initialize the conversion context\n" );
+	}
+	else
+	{
+		sliced_scaler_scale ( &media_state->video_scaler,
+							 media_state->workers,
+							 ( const U8** ) frame->data,
+							 frame->linesize,
+							 planes,
+							 pitches );
+	}
+	
+	SDL_UnlockTexture ( texture );
+	
+	return 0;
+}
+
+// uploads a picture into the next texture of the ring, recreating it when
+// the codec changed size mid stream or a playlist item has another one.
+static bool32 texture_ring_upload ( media_state_t *media_state, video_picture_t *video_picture )
+{
+	S32      slot           = media_state->texture_write;
+	AVFrame *frame          = video_picture->frame;
+	
+	// pictures dropped by a seek after their upload leave texture_write
+	// wherever they got to, possibly on the texture still being shown.
+	if ( slot == media_state->texture_shown )
+	{
+		slot = ( slot + 1 ) % TEXTURE_RING_SIZE;
+	}
+	
+	S32      texture_width  = 0;
+	S32      texture_height = 0;
+	
+	if ( media_state->textures [ slot ] )
+	{
+		SDL_QueryTexture ( media_state->textures [ slot ], 0, 0, &texture_width, &texture_height );
+	}
+	
+	if ( !media_state->textures [ slot ] || texture_width != frame->width || texture_height != frame->height )
+	{
+		if ( media_state->textures [ slot ] )
+		{
+			SDL_DestroyTexture ( media_state->textures [ slot ] );
+		}
+		
+		media_state->textures [ slot ] = SDL_CreateTexture ( media_state->renderer,
+															media_state->texture_format,
+															SDL_TEXTUREACCESS_STREAMING,
+															frame->width,
+															frame->height );
+		if ( !media_state->textures [ slot ] )
+		{
+			fprintf ( stderr, "SDL_CreateTexture Error: %s\n", SDL_GetError ( ) );
+			return false;
+		}
+	}
+	
+	U64 upload_start = TRACE_NOW ( );
+	
+	if ( upload_picture ( media_state, media_state->textures [ slot ], frame ) < 0 )
+	{
+		return false;
+	}
+	
+	trace_span ( TRACE_UPLOAD, upload_start, video_picture->pts );
+	
+	video_picture->texture     = slot;
+	media_state->texture_write = ( slot + 1 ) % TEXTURE_RING_SIZE;
+	media_state->uploaded++;
+	
+	return true;
+}
+
+
+// the largest rectangle with the picture's display aspect ratio that fits
+// the window, centred.
+static void picture_rect ( AVFrame *frame, S32 screen_width, S32 screen_height, SDL_Rect *rect )
+{
+	F32 aspect_ratio;
+	S32 w, h;
+	
+	if ( frame->sample_aspect_ratio.num == 0 )
+	{
+		aspect_ratio = 0;
+	}
+	else
+	{
+		aspect_ratio = av_q2d ( frame->sample_aspect_ratio ) * frame->width / frame->height;
+	}
+	
+	if ( aspect_ratio <= 0.0 )
+	{
+		aspect_ratio = ( F32 ) frame->width / ( F32 ) frame->height;
+	}
+	
+	h = screen_height;
+	
+	w = ( ( S32 ) rint ( h * aspect_ratio ) ) & -3;
+	
+	if ( w > screen_width )
+	{
+		w = screen_width;
+		h = ( ( S32 ) rint ( w / aspect_ratio ) ) & -3;
+	}
+	
+	rect->x = ( screen_width  - w ) / 2;
+	rect->y = ( screen_height - h ) / 2;
+	rect->w = w;
+	rect->h = h;
+}
+
+// software path: the sliced scaler converts and scales the decoded frame
+// straight into the window surface, at the size it is shown. Borders are
+// cleared only when the picture rectangle moves.
+static bool32 surface_upload ( media_state_t *media_state, video_picture_t *video_picture )
+{
+	SDL_Surface *surface = SDL_GetWindowSurface ( media_state->screen );
+	AVFrame     *frame   = video_picture->frame;
+	SDL_Rect     rect;
+	
+	if ( !surface )
+	{
+		fprintf ( stderr, "SDL_GetWindowSurface Error: %s\n", SDL_GetError ( ) );
+		return false;
+	}
+	
+	picture_rect ( frame, surface->w, surface->h, &rect );
+	
+	if ( rect.w <= 0 || rect.h <= 0 )
+	{
+		return false;
+	}
+	
+	if ( sliced_scaler_configure ( &media_state->video_scaler,
+								  frame->width, frame->height, frame->format,
+								  rect.w, rect.h, media_state->output_pix_fmt,
+								  SWS_FAST_BILINEAR, media_state->workers->num_threads + 1 ) < 0 )
+	{
+		fprintf ( stderr, "Could not initialize the conversion context\n" );
+		return false;
+	}
+	
+	if ( surface != media_state->converted_surface || memcmp ( &rect, &media_state->surface_rect, sizeof ( rect ) ) )
+	{
+		SDL_FillRect ( surface, 0, 0 );
+	}
+	
+	U64 upload_start = TRACE_NOW ( );
+	
+	if ( SDL_MUSTLOCK ( surface ) && SDL_LockSurface ( surface ) < 0 )
+	{
+		return false;
+	}
+	
+	U8 *planes  [ 4 ] = { ( U8* ) surface->pixels + rect.y * surface->pitch + rect.x * surface->format->BytesPerPixel };
+	S32 pitches [ 4 ] = { surface->pitch };
+	
+	sliced_scaler_scale ( &media_state->video_scaler,
+						 media_state->workers,
+						 ( const U8** ) frame->data,
+						 frame->linesize,
+						 planes,
+						 pitches );
+	
+	if ( SDL_MUSTLOCK ( surface ) )
+	{
+		SDL_UnlockSurface ( surface );
+	}
+	
+	trace_span ( TRACE_UPLOAD, upload_start, video_picture->pts );
+	
+	media_state->converted_surface = surface;
+	media_state->surface_rect      = rect;
+	media_state->uploaded++;
+	
+	return true;
+}
+
+
+void video_display ( media_state_t *media_state )
+{
+	video_picture_t *video_picture = &media_state->picture_queue [ media_state->picture_queue_read_index ];
+	
+	if ( video_picture->frame )
+	{
+		LOG_EVENT ( LOG_TRACE, LOG_EVENT_FRAME_DISPLAY,
+				   video_picture->frame->pict_type,
+				   media_state->frame_drop.decoded,
+				   video_picture->frame->pts,
+				   video_picture->frame->pkt_dts,
+				   video_picture->frame->width,
+				   video_picture->frame->height );
+		
+		SDL_LockMutex ( media_state->screen_mutex );
+		
+		if ( media_state->software_output )
+		{
+			// converted ahead unless it arrived late or the window was resized since.
+			SDL_Surface *surface = SDL_GetWindowSurface ( media_state->screen );
+			
+			if ( media_state->uploaded == 0 || surface != media_state->converted_surface )
+			{
+				media_state->uploaded = 0;
+				
+				if ( surface_upload ( media_state, video_picture ) )
+				{
+					media_state->presenter.uploads_late++;
+				}
+			}
+			
+			U64 present_start = TRACE_NOW ( );
+			
+			SDL_UpdateWindowSurface ( media_state->screen );
+			
+			trace_span ( TRACE_PRESENT, present_start, video_picture->pts );
+			
+			SDL_UnlockMutex ( media_state->screen_mutex );
+			return;
+		}
+		
+		// normally uploaded well ahead; only a picture that arrived too
+		// close to its refresh is uploaded here.
+		if ( media_state->uploaded == 0 )
+		{
+			if ( !texture_ring_upload ( media_state, video_picture ) )
+			{
+				SDL_UnlockMutex ( media_state->screen_mutex );
+				return;
+			}
+			
+			media_state->presenter.uploads_late++;
+		}
+		
+		SDL_RenderClear ( media_state->renderer );
+		
+		SDL_RenderCopy ( media_state->renderer, media_state->textures [ video_picture->texture ], 0, 0 );
+		
+		media_state->texture_shown = video_picture->texture;
+		
+		U64 present_start = TRACE_NOW ( );
+		
+		SDL_RenderPresent ( media_state->renderer );
+		
+		trace_span ( TRACE_PRESENT, present_start, video_picture->pts );
+		
+		SDL_UnlockMutex ( media_state->screen_mutex );
+	}
+	else
+	{
+		SDL_Event event;
+		event.type       = FF_QUIT_EVENT;
+		event.user.data1 = media_state;
+		SDL_PushEvent ( &event );
+	}
+}
+
+
+
+// the existing audio sync rules, applied to the head picture: returns the
+// presenter clock time at which it should become visible.
+static F64 presenter_target_time ( media_state_t *media_state, video_picture_t *video_picture )
+{
+    F64 pts_delay         = 0;
+    F64 audio_ref_clock   = 0;
+    F64 sync_threshold    = 0;
+    F64 audio_video_delay = 0;
+	
+    pts_delay = video_picture->pts - media_state->frame_last_pts;
+	F64 raw_pts_delay = pts_delay;
+	
+    if ( pts_delay <= 0 || pts_delay >= 1.0 )
+    {
+        pts_delay = media_state->frame_last_delay;
+    }
+	
+	LOG_EVENT ( LOG_DEBUG, LOG_EVENT_FRAME_TIMING, video_picture->pts, media_state->frame_last_pts, raw_pts_delay, pts_delay );
+	
+    media_state->frame_last_delay = pts_delay;
+    media_state->frame_last_pts   = video_picture->pts;
+	
+    audio_ref_clock = get_audio_clock ( media_state );
+	
+    audio_video_delay = video_picture->pts - audio_ref_clock;
+	
+    sync_threshold = ( pts_delay > AV_SYNC_THRESHOLD) ? pts_delay : AV_SYNC_THRESHOLD;
+	
+    if ( media_state->audio_stream && fabs ( audio_video_delay ) < AV_NOSYNC_THRESHOLD )
+    {
+        if ( audio_video_delay <= -sync_threshold )
+        {
+            pts_delay = 0;
+        }
+        else if ( audio_video_delay >= sync_threshold )
+        {
+            pts_delay = 2 * pts_delay;
+        }
+    }
+	
+	LOG_EVENT ( LOG_DEBUG, LOG_EVENT_FRAME_SYNC, audio_ref_clock, audio_video_delay, sync_threshold, pts_delay );
+	
+    media_state->frame_timer += pts_delay;
+	
+	// a presenter that fell far behind (window drag, breakpoint) restarts its
+	// timeline instead of racing through the backlog.
+	if ( presenter_now ( ) - media_state->frame_timer > AV_NOSYNC_THRESHOLD )
+	{
+		media_state->frame_timer = presenter_now ( );
+	}
+	
+    return media_state->frame_timer;
+}
+
+// snaps a target time to the nearest refresh, never earlier than the one
+// after the previous present.
+static F64 presenter_align ( presenter_t *presenter, F64 target )
+{
+	F64 interval = presenter->refresh_interval;
+	
+	if ( presenter->last_vsync <= 0 || interval <= 0 )
+	{
+		return target;
+	}
+	
+	F64 slots = floor ( ( target - presenter->last_vsync ) / interval + 0.5 );
+	
+	return presenter->last_vsync + FFMAX ( slots, 1 ) * interval;
+}
+
+// done is when SDL_RenderPresent returned. With a blocking vsync present
+// that is the refresh the picture landed on, which also re-anchors the grid.
+static void presenter_record ( presenter_t *presenter, F64 done, F64 frame_duration )
+{
+	F64 interval    = presenter->refresh_interval;
+	bool32 blocked  = presenter->vsync && done >= presenter->slot - interval / 4;
+	F64 error       = done - ( blocked || !presenter->vsync ? presenter->slot : presenter->wake );
+	
+	presenter->jitter_total   += fabs ( error );
+	presenter->jitter_squares += error * error;
+	presenter->jitter_max      = FFMAX ( presenter->jitter_max, fabs ( error ) );
+	
+	if ( error > interval / 2 )
+	{
+		presenter->missed_vsyncs++;
+	}
+	
+	// how many refreshes the previous picture stayed up. 24p on 60 Hz should
+	// alternate 3 and 2; anything else is judder.
+	if ( presenter->presented > 0 && presenter->last_slot > 0 && interval > 0 )
+	{
+		S32 hold     = ( S32 ) floor ( ( presenter->slot - presenter->last_slot ) / interval + 0.5 );
+		F64 ratio    = frame_duration / interval;
+		F64 fraction = ratio - floor ( ratio );
+		
+		presenter->pulldown = fabs ( fraction - 0.5 ) < 0.05;
+		
+		if ( hold < floor ( ratio + 0.05 ) || hold > ceil ( ratio - 0.05 ) || ( presenter->pulldown && hold == presenter->last_hold ) )
+		{
+			presenter->cadence_breaks++;
+		}
+		
+		presenter->holds [ FFMIN ( FFMAX ( hold, 0 ), MAX_CADENCE_HOLD ) ]++;
+		presenter->last_hold = hold;
+	}
+	
+	presenter->presented++;
+	presenter->last_slot  = presenter->slot;
+	presenter->last_vsync = blocked ? done : presenter->slot;
+	presenter->scheduled  = false;
+}
+
+// milliseconds the event loop may sleep before the presenter needs the CPU.
+S32 presenter_wait_ms ( media_state_t *media_state )
+{
+	presenter_t *presenter = &media_state->presenter;
+	
+	if ( !presenter->scheduled )
+	{
+		return media_state->picture_queue_size > 0 && media_state->video_output_ready ? 0 : PRESENT_IDLE_WAIT_MS;
+	}
+	
+	F64 remaining = presenter->wake - PRESENT_SPIN_MARGIN - presenter_now ( );
+	
+	return remaining > 0 ? ( S32 ) ( remaining * 1000 ) : 0;
+}
+
+static void presenter_pop ( media_state_t *media_state )
+{
+	// the texture has its own copy: the buffer goes back to the decoder or the picture pool.
+	av_frame_unref ( media_state->picture_queue [ media_state->picture_queue_read_index ].frame );
+	
+	media_state->uploaded = FFMAX ( media_state->uploaded - 1, 0 );
+	
+    if ( ++media_state->picture_queue_read_index == media_state->picture_queue_capacity )
+    {
+        media_state->picture_queue_read_index = 0 ;
+    }
+	
+    SDL_LockMutex ( media_state->picture_queue_mutex );
+	
+    media_state->picture_queue_size--;
+    SDL_CondSignal ( media_state->picture_queue_condition );
+    
+	SDL_UnlockMutex ( media_state->picture_queue_mutex );
+	
+	media_state->presenter.scheduled = false;
+}
+
+// uploads queued pictures into the texture ring as soon as they arrive, so
+// a present is only RenderCopy + RenderPresent. The texture on screen is
+// never reused for the next upload: the GPU may still be reading it.
+static void presenter_upload_ahead ( media_state_t *media_state )
+{
+	presenter_t *presenter = &media_state->presenter;
+	
+	// the window surface holds a single picture.
+	S32 ahead = media_state->software_output ? 1 : TEXTURE_RING_SIZE - 1;
+	
+	while ( media_state->uploaded < FFMIN ( media_state->picture_queue_size, ahead ) )
+	{
+		// never at the expense of a present that is already due.
+		if ( presenter->scheduled && presenter_now ( ) + presenter->upload_cost > presenter->wake - PRESENT_SPIN_MARGIN )
+		{
+			return;
+		}
+		
+		S32 index          = ( media_state->picture_queue_read_index + media_state->uploaded ) % media_state->picture_queue_capacity;
+		F64 upload_start   = presenter_now ( );
+		
+		SDL_LockMutex   ( media_state->screen_mutex );
+		bool32 uploaded = media_state->software_output ? surface_upload      ( media_state, &media_state->picture_queue [ index ] ) :
+		                                                 texture_ring_upload ( media_state, &media_state->picture_queue [ index ] );
+		SDL_UnlockMutex ( media_state->screen_mutex );
+		
+		if ( !uploaded )
+		{
+			return;
+		}
+		
+		// rises at once, decays slowly.
+		F64 cost = presenter_now ( ) - upload_start;
+		presenter->upload_cost = cost > presenter->upload_cost ? cost : 0.9 * presenter->upload_cost + 0.1 * cost;
+		presenter->uploads_ahead++;
+	}
+}
+
+// called from the event loop whenever it wakes. Sleeps are left to the event
+// loop; only the last PRESENT_SPIN_MARGIN before a present is spun here.
+void presenter_update ( media_state_t *media_state )
+{
+	presenter_t *presenter = &media_state->presenter;
+	S32 serial             = SDL_AtomicGet ( &media_state->video_queue.serial );
+	
+	if ( !media_state->video_stream || !media_state->video_output_ready )
+	{
+		return;
+	}
+	
+	// pictures decoded before a seek.
+	while ( media_state->picture_queue_size > 0 && media_state->picture_queue [ media_state->picture_queue_read_index ].serial != serial )
+	{
+		presenter_pop ( media_state );
+	}
+	
+	if ( media_state->picture_queue_size == 0 )
+	{
+		if ( SDL_AtomicGet ( &media_state->video_finished ) && SDL_AtomicGet ( &media_state->video_queue.eof ) &&
+			!SDL_AtomicGet ( &media_state->seek_request ) && packet_queue_count ( &media_state->video_queue ) == 0 )
+		{
+			SDL_Event event;
+			event.type       = FF_QUIT_EVENT;
+			event.user.data1 = media_state;
+			SDL_PushEvent ( &event );
+		}
+		
+		return;
+	}
+	
+	presenter_upload_ahead ( media_state );
+	
+	video_picture_t *video_picture = &media_state->picture_queue [ media_state->picture_queue_read_index ];
+	
+	// first picture after a seek: restart the timeline on it.
+	if ( video_picture->serial != presenter->serial )
+	{
+		presenter->serial             = video_picture->serial;
+		presenter->last_slot          = 0;
+		media_state->frame_last_pts   = video_picture->pts - media_state->frame_last_delay;
+		media_state->frame_timer      = presenter_now ( ) - media_state->frame_last_delay;
+	}
+	
+	if ( !presenter->scheduled )
+	{
+		presenter->target    = presenter_target_time ( media_state, video_picture );
+		presenter->slot      = presenter_align ( presenter, presenter->target );
+		presenter->wake      = presenter->vsync ? presenter->slot - presenter->refresh_interval / 2 : presenter->slot;
+		presenter->scheduled = true;
+		
+		LOG_EVENT ( LOG_DEBUG, LOG_EVENT_FRAME_SCHEDULE, presenter->target - presenter_now ( ), presenter->slot - presenter_now ( ), presenter->slot - presenter->target );
+	}
+	
+	F64 now = presenter_now ( );
+	
+	if ( now < presenter->wake - PRESENT_SPIN_MARGIN )
+	{
+		return;
+	}
+	
+	while ( now < presenter->wake )
+	{
+		now = presenter_now ( );
+	}
+	
+	U64 refresh_start = TRACE_NOW ( );
+	
+    video_display ( media_state );
+	
+	presenter_record ( presenter, presenter_now ( ), media_state->frame_last_delay );
+	
+	if ( !media_state->startup.first_frame )
+	{
+		media_state->startup.first_frame = presenter_now ( );
+	}
+	
+	if ( media_state->seek_requested_at > 0 && !SDL_AtomicGet ( &media_state->seek_request ) && video_picture->serial == media_state->seek_serial )
+	{
+		F64 latency = presenter_now ( ) - media_state->seek_requested_at;
+		
+		media_state->seek_count++;
+		media_state->seek_latency_total += latency;
+		media_state->seek_latency_max    = FFMAX ( media_state->seek_latency_max, latency );
+		media_state->seek_requested_at   = 0;
+	}
+	
+	presenter_pop ( media_state );
+	
+	trace_span ( TRACE_REFRESH, refresh_start, media_state->frame_last_pts );
+}
+
+
+
+
+static int audio_resampler_configure ( audio_resampling_state_t *ars,
+									 AVFrame *decoded_audio_frame,
+									 S64 in_channel_layout,
+									 enum AVSampleFormat out_sample_fmt,
+									 U64 out_channel_layout,
+									 S32 out_sample_rate )
+{
+	S32 ret = -1;
+	
+	swr_free ( &ars->swr_ctx );
+	
+	if ( ars->resampled_data )
+	{
+		av_freep ( &ars->resampled_data [ 0 ] );
+	}
+	av_freep ( &ars->resampled_data );
+	
+	ars->max_out_num_samples = 0;
+	
+	ars->swr_ctx = swr_alloc_set_opts ( 0,
+									   out_channel_layout,
+									   out_sample_fmt,
+									   out_sample_rate,
+									   in_channel_layout,
+									   decoded_audio_frame->format,
+									   decoded_audio_frame->sample_rate,
+									   0,
+									   0 );
+	if ( !ars->swr_ctx )
+	{
+		fprintf ( stderr, "swr_alloc error\n" );
+		return -1;
+	}
+	
+	ret = swr_init ( ars->swr_ctx );
+	if ( ret < 0 )
+	{
+		fprintf ( stderr, "Failed to initialize the resampling context\n" );
+		swr_free ( &ars->swr_ctx );
+		return -1;
+	}
+	
+	ars->in_channel_layout  = in_channel_layout;
+	ars->in_sample_rate     = decoded_audio_frame->sample_rate;
+	ars->in_sample_fmt      = decoded_audio_frame->format;
+	ars->out_channel_layout = out_channel_layout;
+	ars->out_sample_rate    = out_sample_rate;
+	ars->out_sample_fmt     = out_sample_fmt;
+	ars->out_num_channels   = av_get_channel_layout_nb_channels ( out_channel_layout );
+	
+	printf ( "Audio resampler: %s %d Hz %d ch -> %s %d Hz %d ch\n",
+			av_get_sample_fmt_name ( ars->in_sample_fmt ),
+			ars->in_sample_rate,
+			av_get_channel_layout_nb_channels ( ars->in_channel_layout ),
+			av_get_sample_fmt_name ( ars->out_sample_fmt ),
+			ars->out_sample_rate,
+			ars->out_num_channels );
+	
+	return 0;
+}
+
+
+static int audio_resample ( media_state_t *media_state, 
+						   AVFrame *decoded_audio_frame,
+						   enum AVSampleFormat out_sample_fmt,
+						   U8*out_buffer )
+{
+	S32 ret = -1;
+	
+	audio_resampling_state_t *ars = &media_state->audio_resampler;
+	
+	S64 in_channel_layout = ( decoded_audio_frame->channel_layout && 
+							 decoded_audio_frame->channels == av_get_channel_layout_nb_channels ( decoded_audio_frame->channel_layout ) ) ? 
+		decoded_audio_frame->channel_layout :
+	av_get_default_channel_layout ( decoded_audio_frame->channels );
+	
+	if ( in_channel_layout <= 0 )
+	{
+		fprintf ( stderr, "in_channel_layout error\n" );
+		return -1;
+	}
+	
+	ars->in_num_samples = decoded_audio_frame->nb_samples;
+    if ( ars->in_num_samples <= 0 )
+    {
+        printf ( "in_num_samples error\n");
+        return -1;
+    }
+	
+	if ( !ars->swr_ctx                                              ||
+		ars->in_channel_layout != in_channel_layout                 ||
+		ars->in_sample_rate    != decoded_audio_frame->sample_rate  ||
+		ars->in_sample_fmt     != decoded_audio_frame->format       ||
+		ars->out_sample_fmt    != out_sample_fmt )
+	{
+		ret = audio_resampler_configure ( ars,
+										 decoded_audio_frame,
+										 in_channel_layout,
+										 out_sample_fmt,
+										 av_get_default_channel_layout ( media_state->audio_out_channels ),
+										 media_state->audio_out_sample_rate );
+		if ( ret < 0 )
+		{
+			return -1;
+		}
+	}
+	
+	ars->out_num_samples = av_rescale_rnd ( swr_get_delay ( ars->swr_ctx, ars->in_sample_rate ) + ars->in_num_samples,
+										   ars->out_sample_rate,
+										   ars->in_sample_rate,
+										   AV_ROUND_UP );
+	
+	if ( ars->out_num_samples <= 0 )
+	{
+		fprintf ( stderr, "av_rescale_rnd error\n" );
+		return -1;
+	}
+	
+	if ( ars->out_num_samples > ars->max_out_num_samples )
+	{
+		if ( ars->resampled_data )
+		{
+			av_freep ( &ars->resampled_data [ 0 ] );
+		}
+		av_freep ( &ars->resampled_data );
+		
+		ret = av_samples_alloc_array_and_samples ( &ars->resampled_data,
+												  &ars->out_linesize,
+												  ars->out_num_channels,
+												  ars->out_num_samples,
+												  out_sample_fmt,
+												  0 );
+		
+		if ( ret < 0 )
+		{
+			fprintf ( stderr, "av_samples_alloc_array_and_samples() error: Could not allocate destination samples\n" );
+			ars->max_out_num_samples = 0;
+			return -1;
+		}
+		
+		ars->max_out_num_samples = ars->out_num_samples;
+	}
+	
+	ret = swr_convert ( ars->swr_ctx,
+					   ars->resampled_data,
+					   ars->out_num_samples,
+					   ( const U8** ) decoded_audio_frame->data,
+					   decoded_audio_frame->nb_samples );
+	
+	if ( ret < 0 )
+	{
+		fprintf ( stderr, "swr_convert_error\n" );
+		return -1;
+	}
+	
+	ars->resampled_data_size = av_samples_get_buffer_size ( &ars->out_linesize,
+														   ars->out_num_channels,
+														   ret,
+														   out_sample_fmt,
+														   1 );
+	
+	if ( ars->resampled_data_size < 0 )
+	{
+		fprintf ( stderr, "av_samples_get_buffer_size error\n" );
+		return -1;
+	}
+	
+	memcpy ( out_buffer, ars->resampled_data [ 0 ], ars->resampled_data_size );
+	
+	return ars->resampled_data_size;
+}
+
+
+int audio_decode_frame ( media_state_t *media_state, 
+						U8             *audio_buffer, 
+						S32             buffer_size,
+						F64            *pts_ptr )
+{
+	AVPacket *packet = media_state->audio_packet;
+	AVFrame  *frame  = media_state->audio_frame;
 	
-    for ( ; ; )
-    {
-        if ( media_state->quit )
-        {
-            break;
-        }
-		
-        if ( media_state->audio_queue.size > MAX_AUDIO_QUEUE_SIZE || media_state->video_queue.size > MAX_VIDEO_QUEUE_SIZE )
-        {
-            SDL_Delay ( 10 );
-            continue;
-        }
+	S32 data_size = 0;
+	
+	F64 pts       = 0;
+	S32 channels  = 0;
+	
+	for ( ; ; )
+	{
+		if ( media_state->quit )
+		{
+			return -1;
+		}
 		
-        ret =  av_read_frame ( media_state->fmt_ctx, &packet );
-		if ( ret < 0 )
-        {
-			if ( ret == AVERROR_EOF )
-            {
-                media_state->quit = true;
-                break;
+		while ( media_state->audio_packet_size > 0 || media_state->audio_boundary )
+		{
+			bool32 got_frame   = false;
+			S32 len            = 0;
+			const char *failed = "avcodec_receive_frame";
+			U64 decode_start   = stage_timer_start ( );
+			
+			int ret = avcodec_receive_frame ( media_state->audio_codec_ctx, frame );
+			if ( ret == 0 )
+			{
+				got_frame = true;
+			}
+			if ( ret == AVERROR ( EAGAIN ) )
+			{
+				ret = 0;
+			}
+			if ( ret == 0 && !media_state->audio_boundary )
+			{
+				// EAGAIN keeps the packet for the next pass, once a frame is out.
+				failed = "avcodec_send_packet";
+				ret    = avcodec_send_packet ( media_state->audio_codec_ctx, packet );
+				if ( ret == 0 )
+				{
+					len = media_state->audio_packet_size;
+				}
+			}
+			
+			stage_timer_stop ( &media_state->stats.audio_decode, decode_start );
+			trace_span ( TRACE_AUDIO_DECODE, decode_start, got_frame ? media_state->audio_clock : TRACE_NO_PTS );
+			
+			if ( ret == AVERROR_EOF && media_state->audio_boundary )
+			{
+				// drained: switch the decoder over to the next playlist item.
+				playlist_boundary_t *boundary = ( playlist_boundary_t* ) media_state->audio_boundary->data;
+				
+				media_state->audio_codec_ctx = playlist_switch_decoder ( media_state, media_state->audio_codec_ctx, boundary->codecpar );
+				media_state->audio_item      = boundary->item;
+				
+				av_buffer_unref ( &media_state->audio_boundary );
+				break;
+			}
+			
+			if ( ret < 0 && ret != AVERROR ( EAGAIN ) )
+			{
+				fprintf ( stderr, "%s error\n", failed );
+				return -1;
+			}
+			
+			media_state->audio_packet_data += len;
+			media_state->audio_packet_size -= len;
+			data_size          = 0;
+			
+			if ( got_frame )
+			{
+				U64 resample_start = stage_timer_start ( );
+				
+				data_size = audio_resample ( media_state,
+											frame,
+											AV_SAMPLE_FMT_S16,
+											audio_buffer );
+				
+				stage_timer_stop ( &media_state->stats.audio_resample, resample_start );
+				trace_span ( TRACE_AUDIO_RESAMPLE, resample_start, media_state->audio_clock );
+				media_state->stats.audio_frames++;
+				
+                assert ( data_size <= buffer_size );
             }
 			
-            if ( media_state->fmt_ctx->pb->error == 0 )
+            if ( data_size <= 0 )
             {
-                SDL_Delay ( 10 );
                 continue;
             }
-            else
-            {
-                break;
-            }
+			
+			if ( media_state->options.accurate_seek && media_state->audio_serial > 0 &&
+				media_state->audio_clock + ( F64 ) data_size / ( 2.0 * media_state->audio_out_channels * media_state->audio_out_sample_rate ) < media_state->seek_target )
+			{
+				media_state->audio_clock += ( F64 ) data_size / ( 2.0 * media_state->audio_out_channels * media_state->audio_out_sample_rate );
+				continue;
+			}
+			
+			pts                      = media_state->audio_clock;
+            *pts_ptr                 = pts;
+			channels                 = 2 * media_state->audio_out_channels;
+            media_state->audio_clock += ( F64 ) data_size / ( F64 )( channels * media_state->audio_out_sample_rate );
+			
+            return data_size;
         }
 		
-        if ( packet.stream_index == media_state->video_stream_index )
-        {
-            packet_queue_put ( &media_state->video_queue, &packet );
-        }
-        else if ( packet.stream_index == media_state->audio_stream_index )
+        if ( packet->data )
         {
-            packet_queue_put ( &media_state->audio_queue, &packet );
+            av_packet_unref ( packet );
         }
-        else
+		
+		S32 serial = media_state->audio_serial;
+        int ret    = packet_queue_get ( &media_state->audio_queue, packet, 1, &serial );
+		
+        if ( ret < 0 )
         {
-            av_packet_unref ( &packet );
+            return -1;
         }
-    }
-	
-    while ( !media_state->quit )
-    {
-        SDL_Delay ( 100 );
-    }
-	
-	avformat_close_input ( &fmt_ctx );
-	
-	
-	failure:
-    {
-        if ( 1 )
+		
+		if ( serial != media_state->audio_serial )
+		{
+			avcodec_flush_buffers ( media_state->audio_codec_ctx );
+			
+			if ( !media_state->options.bench )
+			{
+				pcm_ring_flush ( &media_state->audio_ring, media_state->audio_device );
+			}
+			
+			media_state->audio_serial = serial;
+		}
+		
+		if ( playlist_is_boundary ( packet ) )
+		{
+			playlist_boundary_t *boundary = ( playlist_boundary_t* ) packet->data;
+			
+			if ( boundary->item != media_state->audio_item )
+			{
+				// next playlist item: hand out what the old decoder still holds first.
+				media_state->audio_boundary = av_buffer_ref ( packet->buf );
+				avcodec_send_packet ( media_state->audio_codec_ctx, 0 );
+			}
+			
+			av_packet_unref ( packet );
+			continue;
+		}
+		
+        media_state->audio_packet_data = packet->data;
+        media_state->audio_packet_size = packet->size;
+		
+        if ( packet->pts != AV_NOPTS_VALUE )
         {
-            SDL_Event event;
-            event.type = FF_QUIT_EVENT;
-            event.user.data1 = media_state;
-            SDL_PushEvent ( &event );
-            return -1;
+            media_state->audio_clock = av_q2d ( media_state->audio_queue.time_base ) * packet->pts;
         }
     }
 	
@@ -360,1079 +5944,1001 @@ int decode_thread ( void *arg )
 }
 
 
-int video_thread ( void *arg )
+static bool32 parse_options ( player_options_t *options, int argc, char **argv )
 {
-    media_state_t *media_state = ( media_state_t* ) arg;
-    bool32 frame_finished = false;
-	S32 ret               = -1;
-	F64 pts               =  0;
-	
-	AVPacket *packet = av_packet_alloc ( );
-    if ( !packet )
-    {
-        fprintf ( stderr, "Could not alloc packet\n" );
-        return -1;
-    }
-	
-	static AVFrame *frame = 0;
-    frame = av_frame_alloc ( );
-    if ( !frame )
-    {
-        fprintf ( stderr, "Could not allocate AVFrame\n" );
-        return -1;
-    }
-	
-    for ( ; ; )
-    {
-        if ( packet_queue_get ( &media_state->video_queue, packet, 1 ) < 0 )
-        {
-            break;
-        }
-		
-		pts = 0;
+	for ( int i = 1; i < argc; i++ )
+	{
+		const char *arg = argv [ i ];
 		
-        int ret = avcodec_send_packet ( media_state->video_codec_ctx, packet );
-        if ( ret < 0 )
+		if ( !strcmp ( arg, "--audio-ring" ) && i + 1 < argc )
 		{
-            fprintf ( stderr, "Error sending packet for decoding\n" );
-            return -1;
-        }
-		
-        while ( ret >= 0 )
-        {
-            ret = avcodec_receive_frame ( media_state->video_codec_ctx, frame );
+			options->audio_ring_ms = atoi ( argv [ ++i ] );
+			if ( options->audio_ring_ms <= 0 )
+			{
+				fprintf ( stderr, "Invalid audio ring size: %s\n", argv [ i ] );
+				return false;
+			}
+		}
+		else if ( !strcmp ( arg, "--pictures" ) && i + 1 < argc )
+		{
+			options->picture_queue_size = atoi ( argv [ ++i ] );
+			if ( options->picture_queue_size < 1 || options->picture_queue_size > MAX_PICTURE_QUEUE_SIZE )
+			{
+				fprintf ( stderr, "Invalid picture queue size: %s\n", argv [ i ] );
+				return false;
+			}
+		}
+		else if ( !strcmp ( arg, "--threads" ) && i + 1 < argc )
+		{
+			const char *value = argv [ ++i ];
 			
-            if ( ret == AVERROR ( EAGAIN ) || ret == AVERROR_EOF )
-            {
-                break;
-            }
-            else if ( ret < 0 )
-            {
-                fprintf ( stderr, "Error while decoding\n" );
-                return -1;
-            }
-            else
-            {
-                frame_finished = true;
-            }
+			options->decoder_threads = strcmp ( value, "auto" ) ? atoi ( value ) : 0;
+			if ( options->decoder_threads < 0 || ( options->decoder_threads == 0 && strcmp ( value, "auto" ) ) )
+			{
+				fprintf ( stderr, "Invalid thread count: %s\n", value );
+				return false;
+			}
+		}
+		else if ( !strcmp ( arg, "--thread-type" ) && i + 1 < argc )
+		{
+			const char *value = argv [ ++i ];
 			
-            pts = guess_correct_pts ( media_state->video_codec_ctx, frame->pts, frame->pkt_dts);
+			if ( !strcmp ( value, "frame" ) )
+			{
+				options->decoder_thread_type = FF_THREAD_FRAME;
+			}
+			else if ( !strcmp ( value, "slice" ) )
+			{
+				options->decoder_thread_type = FF_THREAD_SLICE;
+			}
+			else if ( !strcmp ( value, "both" ) )
+			{
+				options->decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+			}
+			else if ( !strcmp ( value, "auto" ) )
+			{
+				options->decoder_thread_type = 0;
+			}
+			else
+			{
+				fprintf ( stderr, "Invalid thread type: %s\n", value );
+				return false;
+			}
+		}
+		else if ( !strcmp ( arg, "--bench" ) )
+		{
+			options->bench = true;
+		}
+		else if ( !strcmp ( arg, "--no-audio" ) )
+		{
+			options->no_audio = true;
+		}
+		else if ( !strcmp ( arg, "--accurate-seek" ) )
+		{
+			options->accurate_seek = true;
+		}
+		else if ( !strcmp ( arg, "--index" ) )
+		{
+			options->build_index = true;
+		}
+		else if ( !strcmp ( arg, "--mmap" ) )
+		{
+			options->mmap_input = true;
+		}
+		else if ( !strcmp ( arg, "--cache-mb" ) && i + 1 < argc )
+		{
+			options->cache_mb = atoi ( argv [ ++i ] );
+			if ( options->cache_mb < MIN_CACHE_MB )
+			{
+				fprintf ( stderr, "Invalid cache size: %s (at least %d MB)\n", argv [ i ], MIN_CACHE_MB );
+				return false;
+			}
+		}
+		else if ( !strcmp ( arg, "--log-level" ) && i + 1 < argc )
+		{
+			static const char *levels [ ] = { "error", "warning", "info", "debug", "trace" };
+			const char *value             = argv [ ++i ];
 			
-            if ( pts == AV_NOPTS_VALUE )
-            {
-                pts = 0;
-            }
+			options->log_level = -1;
+			
+			for ( S32 level = LOG_ERROR; level <= LOG_TRACE; level++ )
+			{
+				if ( !strcmp ( value, levels [ level ] ) )
+				{
+					options->log_level = level;
+				}
+			}
 			
-            pts *= av_q2d ( media_state->video_stream->time_base );
+			if ( options->log_level < 0 )
+			{
+				fprintf ( stderr, "Invalid log level: %s\n", value );
+				return false;
+			}
+		}
+		else if ( !strcmp ( arg, "--log-file" ) && i + 1 < argc )
+		{
+			options->log_file = argv [ ++i ];
+		}
+		else if ( !strcmp ( arg, "--decode-log" ) && i + 1 < argc )
+		{
+			options->decode_log = argv [ ++i ];
+		}
+		else if ( !strcmp ( arg, "--trace" ) && i + 1 < argc )
+		{
+			options->trace_file = argv [ ++i ];
+		}
+		else if ( !strcmp ( arg, "--loop" ) )
+		{
+			options->loop = true;
+		}
+		else if ( !strcmp ( arg, "--multi" ) )
+		{
+			options->multi = true;
+		}
+		else if ( !strcmp ( arg, "--huge-pages" ) )
+		{
+			options->huge_pages = true;
+		}
+		else if ( !strcmp ( arg, "--alloc-stats" ) )
+		{
+			options->alloc_stats = true;
+		}
+		else if ( !strcmp ( arg, "--fast-start" ) )
+		{
+			options->fast_start = true;
+		}
+		else if ( !strcmp ( arg, "--probesize" ) && i + 1 < argc )
+		{
+			options->probesize = atoll ( argv [ ++i ] );
+			if ( options->probesize < 32 )
+			{
+				fprintf ( stderr, "Invalid probe size: %s (at least 32 bytes)\n", argv [ i ] );
+				return false;
+			}
+		}
+		else if ( !strcmp ( arg, "--analyzeduration" ) && i + 1 < argc )
+		{
+			options->analyze_ms = atoi ( argv [ ++i ] );
+			if ( options->analyze_ms <= 0 )
+			{
+				fprintf ( stderr, "Invalid analyze duration: %s\n", argv [ i ] );
+				return false;
+			}
+		}
+		else if ( arg [ 0 ] == '-' && arg [ 1 ] == '-' )
+		{
+			fprintf ( stderr, "Unknown option: %s\n", arg );
+			return false;
+		}
+		else
+		{
+			if ( !options->inputs )
+			{
+				options->inputs = av_mallocz ( argc * sizeof ( char* ) );
+				assert ( options->inputs );
+			}
 			
-            if ( frame_finished )
-            {
-				pts = synchronize_video ( media_state, frame, pts );
-                if ( queue_picture ( media_state, frame, pts ) < 0 )
-                {
-                    break;
-                }
-            }
-        }
-		
-        av_packet_unref ( packet );
-    }
+			options->inputs [ options->num_inputs++ ] = arg;
+			options->filename = options->filename ? options->filename : arg;
+		}
+	}
 	
-    av_frame_free ( &frame );
-    av_free       (  frame );
+	if ( options->multi && ( options->bench || options->num_inputs > MAX_PLAYERS ) )
+	{
+		fprintf ( stderr, "--multi takes at most %d inputs and cannot be combined with --bench\n", MAX_PLAYERS );
+		return false;
+	}
 	
-    return 0;
+	if ( options->alloc_stats && options->bench )
+	{
+		fprintf ( stderr, "--alloc-stats measures playback and cannot be combined with --bench\n" );
+		return false;
+	}
+	
+	return options->filename != 0 || options->decode_log != 0;
 }
 
 
-
-F64 get_audio_clock ( media_state_t* media_state )
+static void playlist_add ( playlist_t *playlist, const char *list, const char *entry )
 {
-	F64 pts                  = media_state->audio_clock;
-    F32 hardware_buffer_size = media_state->audio_buffer_size - media_state->audio_buffer_index;
-    F32 bytes_per_second     = 0;
-    S32 n                    = 2 * media_state->audio_codec_ctx->channels;
+	const char *slash = list ? FFMAX ( strrchr ( list, '/' ), strrchr ( list, '\\' ) ) : 0;
+	char path [ 1024 ];
 	
-    if ( media_state->audio_stream )
-    {
-        bytes_per_second = media_state->audio_codec_ctx->sample_rate * n;
-    }
+	// list entries are relative to the list, unless absolute or a URL.
+	if ( slash && entry [ 0 ] != '/' && entry [ 0 ] != '\\' && !strchr ( entry, ':' ) )
+	{
+		snprintf ( path, sizeof ( path ), "%.*s%s", ( int ) ( slash - list + 1 ), list, entry );
+	}
+	else
+	{
+		av_strlcpy ( path, entry, sizeof ( path ) );
+	}
 	
-    if ( bytes_per_second )
-    {
-        pts -= ( F64 ) hardware_buffer_size / bytes_per_second;
-    }
+	playlist->items = av_realloc_array ( playlist->items, playlist->count + 1, sizeof ( char* ) );
+	assert ( playlist->items );
 	
-    return pts;
+	playlist->items [ playlist->count++ ] = av_strdup ( path );
 }
 
-
-audio_resampling_state_t* get_audio_resampling ( U64 channel_layout )
+// an HLS media or master playlist rather than a list of files.
+static bool32 playlist_is_hls ( FILE *file )
 {
-	audio_resampling_state_t* ars =
-		av_mallocz ( sizeof ( audio_resampling_state_t ) );
+	char line [ 2048 ];
+	bool32 hls = false;
+	
+	while ( !hls && fgets ( line, sizeof ( line ), file ) )
+	{
+		hls = !strncmp ( line, "#EXT-X-", 7 );
+	}
 	
-    ars->swr_ctx             = swr_alloc();
-    ars->in_channel_layout   = channel_layout;
-    ars->out_channel_layout  = AV_CH_LAYOUT_STEREO;
-    ars->out_num_channels    = 0;
-    ars->out_linesize        = 0;
-    ars->in_num_samples      = 0;
-    ars->out_num_samples     = 0;
-    ars->max_out_num_samples = 0;
-    ars->resampled_data      = 0;
-    ars->resampled_data_size = 0;
+	rewind ( file );
 	
-    return ars;
+	return hls;
 }
 
-void audio_callback ( void * userdata, U8 *stream, S32 length )
+// expands the inputs in order: media files are taken as they are, .m3u and
+// .m3u8 lists and ffconcat scripts contribute their entries. URLs and HLS
+// playlists are left to libavformat.
+static S32 playlist_load ( playlist_t *playlist, const char **inputs, S32 num_inputs )
 {
-	media_state_t *media_state = ( media_state_t* ) userdata;
-	
-    S32 len        =-1;
-    U32 audio_size =-1;
-	F64 pts        = 0;
-	
-    while ( length > 0 )
-    {
-        if ( media_state->quit )
-        {
-            return;
-        }
-		
-        if ( media_state->audio_buffer_index >= media_state->audio_buffer_size )
-        {
-            audio_size = audio_decode_frame ( media_state, 
-											 media_state->audio_buffer, sizeof ( media_state->audio_buffer ), &pts );
-			
-            if ( audio_size < 0 )
-            {
-                media_state->audio_buffer_size = ( 1024 );
-                memset ( media_state->audio_buffer, 0, media_state->audio_buffer_size );
-                printf ( "audio_decode_frame() failed!\n"   );
-            }
-            else
-            {
-                media_state->audio_buffer_size = audio_size;
-            }
-			
-            media_state->audio_buffer_index = 0;
-        }
-		
-        len = media_state->audio_buffer_size - media_state->audio_buffer_index;
+	for ( S32 i = 0; i < num_inputs; i++ )
+	{
+		const char *extension = strrchr ( inputs [ i ], '.' );
+		bool32      url       = strstr ( inputs [ i ], "://" ) != 0;
+		FILE       *file      = url ? 0 : fopen ( inputs [ i ], "r" );
+		char line [ 2048 ]    = { 0 };
 		
-        if ( len > length )
-        {
-            len = length ;
-        }
+		bool32 m3u    = !url && extension && ( !av_strcasecmp ( extension, ".m3u" ) || !av_strcasecmp ( extension, ".m3u8" ) ) && !( file && playlist_is_hls ( file ) );
+		bool32 concat = !m3u && file && fgets ( line, sizeof ( line ), file ) && !strncmp ( line, "ffconcat version", 16 );
 		
-        memcpy ( stream, ( U8* ) media_state->audio_buffer + media_state->audio_buffer_index, len );
+		if ( !m3u && !concat )
+		{
+			playlist_add ( playlist, 0, inputs [ i ] );
+		}
+		else if ( !file )
+		{
+			fprintf ( stderr, "Couldn't open playlist: %s\n", inputs [ i ] );
+			return -1;
+		}
+		else
+		{
+			rewind ( file );
+			
+			while ( fgets ( line, sizeof ( line ), file ) )
+			{
+				char *entry = line;
+				char *end   = line + strlen ( line );
+				
+				while ( end > entry && ( end [ -1 ] == '\n' || end [ -1 ] == '\r' || end [ -1 ] == ' ' || end [ -1 ] == '\t' ) )
+				{
+					*--end = 0;
+				}
+				
+				while ( *entry == ' ' || *entry == '\t' )
+				{
+					entry++;
+				}
+				
+				if ( concat )
+				{
+					// only the file directives; durations and inpoints are not used.
+					if ( strncmp ( entry, "file ", 5 ) )
+					{
+						continue;
+					}
+					
+					for ( entry += 5; *entry == ' '; entry++ );
+					
+					if ( entry [ 0 ] == '\'' && end > entry + 1 && end [ -1 ] == '\'' )
+					{
+						*--end = 0;
+						entry++;
+					}
+				}
+				
+				if ( entry [ 0 ] && entry [ 0 ] != '#' )
+				{
+					playlist_add ( playlist, inputs [ i ], entry );
+				}
+			}
+		}
 		
-		length -= len;
-		stream += len;
-		media_state->audio_buffer_index += len;
+		if ( file )
+		{
+			fclose ( file );
+		}
+	}
+	
+	if ( playlist->count == 0 )
+	{
+		fprintf ( stderr, "The playlist is empty\n" );
+		return -1;
 	}
+	
+	return 0;
 }
 
-
-
-void packet_queue_init ( packet_queue_t *queue )
+static void playlist_free ( playlist_t *playlist )
 {
-	memset ( queue, 0, sizeof ( packet_queue_t ) );
-	queue->mutex = SDL_CreateMutex ( );
-	if ( !queue->mutex )
+	for ( S32 i = 0; i < playlist->count; i++ )
 	{
-		fprintf ( stderr, "SDL_CreateMutex Error: %s\n", SDL_GetError ( ) );
-		return;
+		av_freep ( &playlist->items [ i ] );
 	}
 	
-	queue->condition = SDL_CreateCond ( );
-	if ( !queue->condition )
+	for ( S32 i = 0; i < PLAYLIST_PREFETCH_PACKETS; i++ )
 	{
-		fprintf ( stderr, "SDL_CreateCond Error: %s\n", SDL_GetError ( ) );
-		return;
+		av_packet_free ( &playlist->prefetch.packets [ i ] );
 	}
+	
+	av_freep ( &playlist->items );
+	playlist->count = 0;
 }
 
-int packet_queue_put ( packet_queue_t *queue, AVPacket *packet )
+
+static F64 startup_ms ( startup_times_t *startup, F64 time )
 {
-	
-	AVPacketList *av_packet_list = av_malloc ( sizeof ( AVPacketList ) );
-	assert ( av_packet_list );
-	
-    av_packet_list->pkt  = *packet;
-	
-    av_packet_list->next = 0;
-	
-    SDL_LockMutex ( queue->mutex );
-	
-    if ( !queue->last_packet )
-    {
-        queue->first_packet = av_packet_list;
-    }
-    else
-    {
-        queue->last_packet->next = av_packet_list;
-    }
-	
-    queue->last_packet = av_packet_list;
-	
-    queue->num_packets++;
-	
-    queue->size += av_packet_list->pkt.size;
-	
-    SDL_CondSignal ( queue->condition );
-	
-    SDL_UnlockMutex ( queue->mutex );
-	
-    return 0;
+	return time > 0 ? 1000.0 * ( time - startup->launched ) : 0.0;
 }
 
-int packet_queue_get ( packet_queue_t *queue, AVPacket *packet, int block )
+
+void print_playback_stats ( media_state_t *media_state )
 {
-	S32 ret                      = 0;
-    AVPacketList *av_packet_list = 0;
-    SDL_LockMutex ( queue->mutex );
+	startup_times_t *startup = &media_state->startup;
 	
-    for ( ;; )
-    {
-        if ( global_media_state->quit )
-        {
-            ret = -1;
-            break;
-        }
-		
-		av_packet_list = queue->first_packet;
+	if ( startup->first_frame > 0 )
+	{
+		printf ( "Startup:                input %.1f ms, streams %.1f ms, codecs %.1f ms, window %.1f ms\n",
+				startup_ms ( startup, startup->input_opened ),
+				startup_ms ( startup, startup->streams_probed ),
+				startup_ms ( startup, startup->codecs_opened ),
+				startup_ms ( startup, startup->window_ready ) );
+		printf ( "Time to first frame:    %.1f ms\n", startup_ms ( startup, startup->first_frame ) );
 		
-        if ( av_packet_list )
-        {
-            queue->first_packet = av_packet_list->next;
-			
-            if ( !queue->first_packet )
-            {
-                queue->last_packet = 0;
-            }
-			
-            queue->num_packets--;
-			
-            queue->size -= av_packet_list->pkt.size;
-			
-            *packet = av_packet_list->pkt;
-			
-            av_free ( av_packet_list );
-			
-            ret = 1;
-            
-			break;
-        }
-        else if ( !block )
-        {
-            ret = 0;
-            break;
-        }
-        else
-        {
-            SDL_CondWait ( queue->condition, queue->mutex );
-        }
-    }
-    
-	SDL_UnlockMutex ( queue->mutex );
+		if ( startup->first_audio > 0 )
+		{
+			printf ( "Time to first audio:    %.1f ms\n", startup_ms ( startup, startup->first_audio ) );
+		}
+	}
 	
-    return ret;
-}
 
-
-int stream_component_open ( media_state_t *media_state, S32 stream_index )
-{
+	if ( media_state->video_stream )
+	{
+		frame_drop_state_t *drop = &media_state->frame_drop;
+		
+		printf ( "Video frames decoded:   %d\n", drop->decoded );
+		printf ( "Dropped before display: %d\n", drop->dropped );
+		printf ( "Skipped by decoder:     %d\n", FFMAX ( drop->packets - drop->decoded, 0 ) );
+	}
 	
-    AVFormatContext *fmt_ctx = media_state->fmt_ctx;
-	S32 ret = -1;
+	presenter_t *presenter = &media_state->presenter;
 	
-    if ( stream_index < 0 || stream_index >= fmt_ctx->nb_streams )
-    {
-        printf ( "Invalid stream index\n" );
-        return -1;
-    }
+	if ( presenter->presented > 0 )
+	{
+		printf ( "Presented frames:       %d at %.2f Hz (%s)\n",
+				presenter->presented,
+				1.0 / presenter->refresh_interval,
+				presenter->vsync ? "vsync" : "no vsync" );
+		printf ( "Present jitter:         mean %.3f ms, rms %.3f ms, max %.3f ms\n",
+				1000.0 * presenter->jitter_total / presenter->presented,
+				1000.0 * sqrt ( presenter->jitter_squares / presenter->presented ),
+				1000.0 * presenter->jitter_max );
+		printf ( "Missed vsyncs:          %d\n", presenter->missed_vsyncs );
+		printf ( "Texture uploads:        %d ahead of their refresh, %d at it\n", presenter->uploads_ahead, presenter->uploads_late );
+		printf ( "Cadence:                %s, %d breaks, holds",
+				presenter->pulldown ? "3:2 pulldown" : "regular",
+				presenter->cadence_breaks );
+		
+		for ( S32 hold = 0; hold <= MAX_CADENCE_HOLD; hold++ )
+		{
+			if ( presenter->holds [ hold ] )
+			{
+				printf ( " %d%s:%d", hold, hold == MAX_CADENCE_HOLD ? "+" : "", presenter->holds [ hold ] );
+			}
+		}
+		
+		printf ( "\n" );
+	}
 	
+	if ( media_state->picture_pool.reconfigured > 0 )
+	{
+		printf ( "Picture pool:           %d buffers of %.1f MB allocated, %d formats/sizes\n",
+				SDL_AtomicGet ( &media_state->picture_pool.allocated ),
+				media_state->picture_pool.size / ( 1024.0 * 1024.0 ),
+				media_state->picture_pool.reconfigured );
+	}
 	
-	const AVCodec *codec = avcodec_find_decoder( fmt_ctx->streams [ stream_index ]->codecpar->codec_id );
-	if ( !codec )
-    {
-        printf ( "Unsupported codec\n" );
-        return -1;
-    }
+	if ( media_state->decoder_pool.reconfigured > 0 )
+	{
+		printf ( "Decoder pool:           %d buffers of %.1f MB allocated, %d formats/sizes\n",
+				SDL_AtomicGet ( &media_state->decoder_pool.allocated ),
+				media_state->decoder_pool.size / ( 1024.0 * 1024.0 ),
+				media_state->decoder_pool.reconfigured );
+	}
 	
-    AVCodecContext *codec_ctx = avcodec_alloc_context3 ( codec );
-    if ( avcodec_parameters_to_context ( codec_ctx, fmt_ctx->streams [ stream_index ]->codecpar ) < 0 )
-    {
-        printf ( "Could not copy codec context\n" );
-        return -1;
-    }
+	if ( media_state->read_cache )
+	{
+		read_cache_print_stats ( media_state->read_cache );
+	}
 	
-    if ( codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO )
-    {
-        SDL_AudioSpec wanted_specs = { 0 };
-        SDL_AudioSpec specs        = { 0 };
-		
-        wanted_specs.freq     = codec_ctx->sample_rate;
-        wanted_specs.format   = AUDIO_S16SYS;
-        wanted_specs.channels = codec_ctx->channels;
-        wanted_specs.silence  = 0;
-        wanted_specs.samples  = SDL_AUDIO_BUFFER_SIZE;
-        wanted_specs.callback = audio_callback;
-        wanted_specs.userdata = media_state;
-		
-        
-		if ( SDL_OpenAudio ( &wanted_specs, &specs ) < 0 )
-        {
-            fprintf ( stderr, "SDL_OpenAudio: %s\n", SDL_GetError ( ) );
-            return -1;
-        }
-    }
+	if ( media_state->playlist.sequence > 0 )
+	{
+		printf ( "Playlist:               %d items played, decoders reused %d times, reopened %d times\n",
+				media_state->playlist.sequence + 1,
+				SDL_AtomicGet ( &media_state->playlist.decoders_reused ),
+				SDL_AtomicGet ( &media_state->playlist.decoders_opened ) );
+	}
 	
-    if ( avcodec_open2 ( codec_ctx, codec, 0 ) < 0 )
-    {
-		printf ( "Unsupported codec!\n" );
-		return -1;
+	if ( media_state->seek_count > 0 )
+	{
+		printf ( "Seeks:                  %d, first frame after %.1f ms mean, %.1f ms max\n",
+				media_state->seek_count,
+				1000.0 * media_state->seek_latency_total / media_state->seek_count,
+				1000.0 * media_state->seek_latency_max );
 	}
 	
-	switch ( codec_ctx->codec_type )
+	if ( media_state->audio_stream )
 	{
-		case AVMEDIA_TYPE_AUDIO:
-		{
-			media_state->audio_stream_index = stream_index;
-			media_state->audio_stream       = fmt_ctx->streams [ stream_index ];
-			media_state->audio_codec_ctx    = codec_ctx;
-			media_state->audio_buffer_size  = 0;
-			media_state->audio_buffer_index = 0;
-			
-			memset ( &media_state->audio_packet, 0, sizeof ( media_state->audio_packet ) );
-			packet_queue_init ( &media_state->audio_queue );
-			SDL_PauseAudio ( 0 );
-			
-		} break;
+		F64 bytes_per_second = 2.0 * media_state->audio_out_channels * media_state->audio_out_sample_rate;
 		
-		case AVMEDIA_TYPE_VIDEO:
-		{
-			media_state->video_stream_index  = stream_index;
-			media_state->video_stream        = fmt_ctx->streams [ stream_index ];
-			media_state->video_codec_ctx     = codec_ctx;
-			
-			
-            media_state->frame_timer      = ( F64 ) av_gettime ( ) / 1000000.0;
-			media_state->frame_last_delay = 40e-3;
-			
-			packet_queue_init ( &media_state->video_queue );
-			
-			media_state->video_thread_id = SDL_CreateThread ( video_thread, "Video Thread", media_state );
-			
-			media_state->sws_ctx = sws_getContext ( media_state->video_codec_ctx->width,
-												   media_state->video_codec_ctx->height,
-												   media_state->video_codec_ctx->pix_fmt,
-												   media_state->video_codec_ctx->width,
-												   media_state->video_codec_ctx->height,
-												   AV_PIX_FMT_YUV420P,
-												   SWS_BILINEAR,
-												   0,
-												   0,
-												   0 );
-            screen_mutex = SDL_CreateMutex ( );
-			
-		} break;
-		
-        default:
-        {
-        } break;
-    }
-	
-    return 0;
-}
-
-
-static uint32_t sdl_refresh_timer_callback ( uint32_t interval, void *param )
-{
-    SDL_Event event  = { 0 };
-    event.type       = FF_REFRESH_EVENT;
-    event.user.data1 = param;
-    SDL_PushEvent ( &event );
-	
-    return 0;
+		printf ( "Audio underruns:        %d (%.1f ms of silence)\n",
+				SDL_AtomicGet ( &media_state->audio_ring.underruns ),
+				bytes_per_second > 0 ? 1000.0 * SDL_AtomicGet ( &media_state->audio_ring.underrun_bytes ) / bytes_per_second : 0.0 );
+	}
 }
 
 
-static void schedule_refresh ( media_state_t *media_state, int delay )
-{
-    S32 ret = SDL_AddTimer ( delay, sdl_refresh_timer_callback, media_state );
-	
-    if ( ret == 0 )
-    {
-        printf ( "Could not schedule refresh callback: %s\n", SDL_GetError ( ) );
-    }
+F64 get_master_clock ( media_state_t *media_state )
+{
+	return media_state->audio_stream ? get_audio_clock ( media_state ) : media_state->frame_last_pts;
 }
 
-void alloc_picture ( void *userdata )
+// seeks by increment seconds from position (both in stream time). Ignored
+// while a previous seek is still being carried out by the demux thread.
+void stream_seek ( media_state_t *media_state, F64 position, F64 increment )
 {
-    media_state_t   *media_state   = ( media_state_t* ) userdata;
-    video_picture_t *video_picture = &media_state->picture_queue [ media_state->picture_queue_write_index ];
-	
-	if ( video_picture->frame )
+	if ( SDL_AtomicGet ( &media_state->seek_request ) || !media_state->fmt_ctx )
 	{
-		av_frame_free ( &video_picture->frame );
-		av_free       (  video_picture->frame );
+		return;
 	}
-	SDL_LockMutex ( screen_mutex );
-	
-	int num_bytes = av_image_get_buffer_size ( AV_PIX_FMT_YUV420P,
-											  media_state->video_codec_ctx->width,
-											  media_state->video_codec_ctx->height,
-											  32 );
 	
-	U8 *buffer = ( U8* ) av_malloc ( num_bytes * sizeof ( U8 ) );
+	// playlists seek within the item being demuxed.
+	playlist_t *playlist = &media_state->playlist;
+	F64 target           = FFMAX ( position + increment, playlist->start );
 	
-	video_picture->frame = av_frame_alloc ( );
-	if ( !video_picture->frame )
+	if ( playlist->duration > 0 )
 	{
-		fprintf ( stderr, "Could not allocate frame\n" );
-		return;
+		target = FFMIN ( target, playlist->start + playlist->duration );
 	}
 	
-	av_image_fill_arrays ( video_picture->frame->data,
-						  video_picture->frame->linesize,
-						  buffer,
-						  AV_PIX_FMT_YUV420P,
-						  media_state->video_codec_ctx->width,
-						  media_state->video_codec_ctx->height,
-						  32 );
+	media_state->seek_pos          = ( S64 ) ( target * AV_TIME_BASE );
+	media_state->seek_increment    = ( S64 ) ( increment * AV_TIME_BASE );
+	media_state->seek_requested_at = presenter_now ( );
 	
-    SDL_UnlockMutex ( screen_mutex );
+	SDL_AtomicSet ( &media_state->seek_request, true );
 	
-    video_picture->width     = media_state->video_codec_ctx->width;
-    video_picture->height    = media_state->video_codec_ctx->height;
-    video_picture->allocated = true;
+	SDL_LockMutex     ( media_state->demux_space.mutex );
+	SDL_CondBroadcast ( media_state->demux_space.condition );
+	SDL_UnlockMutex   ( media_state->demux_space.mutex );
 }
 
-int queue_picture ( media_state_t *media_state, AVFrame *frame, F64 pts )
+// stops one player; the others keep running.
+static void player_stop ( media_state_t *media_state )
 {
-    SDL_LockMutex ( media_state->picture_queue_mutex );
-	
-    while ( media_state->picture_queue_size >= VIDEO_PICTURE_QUEUE_SIZE && !media_state->quit )
-    {
-        SDL_CondWait ( media_state->picture_queue_condition, media_state->picture_queue_mutex );
-    }
-	
-    SDL_UnlockMutex ( media_state->picture_queue_mutex );
-	
-    if ( media_state->quit )
-    {
-        return -1;
-    }
+	media_state->quit = true;
+	packet_queue_abort ( &media_state->audio_queue );
+	packet_queue_abort ( &media_state->video_queue );
+	pcm_ring_abort     ( &media_state->audio_ring  );
 	
-    video_picture_t *video_picture = &media_state->picture_queue [ media_state->picture_queue_write_index ];
+	SDL_LockMutex     ( media_state->demux_space.mutex );
+	SDL_CondBroadcast ( media_state->demux_space.condition );
+	SDL_UnlockMutex   ( media_state->demux_space.mutex );
 	
-    if ( !video_picture->frame || video_picture->width != media_state->video_codec_ctx->width || video_picture->height != media_state->video_codec_ctx->height )
-    {
-        video_picture->allocated = false;
-        alloc_picture ( media_state );
-        if ( media_state->quit )
-        {
-            return -1;
-        }
-    }
+	// the video thread may be waiting for a free picture slot.
+	SDL_LockMutex     ( media_state->picture_queue_mutex );
+	SDL_CondBroadcast ( media_state->picture_queue_condition );
+	SDL_UnlockMutex   ( media_state->picture_queue_mutex );
 	
-    if ( video_picture->frame )
-    {
-		video_picture->pts                           = pts;
-        video_picture->frame->pict_type              = frame->pict_type;
-        video_picture->frame->pts                    = frame->pts;
-        video_picture->frame->pkt_dts                = frame->pkt_dts;
-        video_picture->frame->key_frame              = frame->key_frame;
-        video_picture->frame->coded_picture_number   = frame->coded_picture_number;
-        video_picture->frame->display_picture_number = frame->display_picture_number;
-        video_picture->frame->width                  = frame->width;
-        video_picture->frame->height                 = frame->height;
-		
-        sws_scale ( media_state->sws_ctx,
-				   ( U8 const* const* ) frame->data,
-				   frame->linesize,
-				   0,
-				   media_state->video_codec_ctx->height,
-				   video_picture->frame->data,
-				   video_picture->frame->linesize );
-		
-        ++media_state->picture_queue_write_index;
-		
-        if ( media_state->picture_queue_write_index == VIDEO_PICTURE_QUEUE_SIZE )
-        {
-            media_state->picture_queue_write_index = 0;
-        }
-		
-        SDL_LockMutex   ( media_state->picture_queue_mutex );
-        media_state->picture_queue_size++;
-        SDL_UnlockMutex ( media_state->picture_queue_mutex );
-    }
+	if ( media_state->audio_device )
+	{
+		SDL_PauseAudioDevice ( media_state->audio_device, 1 );
+	}
 	
-    return 0;
+	if ( media_state->screen && media_state->options.num_players > 1 )
+	{
+		SDL_HideWindow ( media_state->screen );
+	}
 }
 
-void video_display ( media_state_t *media_state )
+// main thread, after player_stop: joins the player's threads and frees its
+// decoders, device, window and queues. Only what print_playback_stats reads
+// is kept; player_free releases that. Closing twice does nothing.
+static void player_close ( media_state_t *media_state )
 {
-	if ( !screen )
-	{
-		if ( ( media_state->video_codec_ctx->width <= 1280 ) && ( media_state->video_codec_ctx->height <= 720 ) )
-		{
-			
-			screen = SDL_CreateWindow ( "5433D R32433 <saeed@rezaee.net>",
-									   SDL_WINDOWPOS_UNDEFINED,
-									   SDL_WINDOWPOS_UNDEFINED,
-									   media_state->video_codec_ctx->width,
-									   media_state->video_codec_ctx->height,
-									   SDL_WINDOW_OPENGL | SDL_WINDOW_ALLOW_HIGHDPI );
-		}
-		else 
-		{
-			screen = SDL_CreateWindow ( "5433D R32433 <saeed@rezaee.net>",
-									   SDL_WINDOWPOS_UNDEFINED,
-									   SDL_WINDOWPOS_UNDEFINED,
-									   media_state->video_codec_ctx->width / 2,
-									   media_state->video_codec_ctx->height / 2,
-									   SDL_WINDOW_OPENGL | SDL_WINDOW_ALLOW_HIGHDPI );
-			
-		}
-		
-		
-		
-		SDL_GL_SetSwapInterval ( 1 );
-	}
-	if ( !screen )
+	if ( !media_state->picture_queue_mutex )
 	{
-		fprintf ( stderr, "SDL: could not create window - exiting\n" );
 		return;
 	}
 	
-	if ( !media_state->renderer )
+	SDL_WaitThread ( media_state->decode_thread_id, 0 );
+	
+	// started by the demux thread, so known once it is gone.
+	SDL_WaitThread ( media_state->video_thread_id, 0 );
+	SDL_WaitThread ( media_state->audio_thread_id, 0 );
+	
+	media_state->decode_thread_id = 0;
+	media_state->video_thread_id  = 0;
+	media_state->audio_thread_id  = 0;
+	
+	if ( media_state->audio_device )
 	{
-		media_state->renderer = SDL_CreateRenderer ( screen, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_TARGETTEXTURE );
+		SDL_CloseAudioDevice ( media_state->audio_device );
+		media_state->audio_device = 0;
 	}
 	
-	if ( !media_state->texture )
+	// the demux thread has closed these unless it failed on the way.
+	playlist_prefetch_finish ( media_state, false );
+	keyframe_index_close ( &media_state->keyframe_index );
+	avformat_close_input ( &media_state->fmt_ctx );
+	read_cache_close     ( media_state->read_cache );
+	mapped_input_close   ( media_state->mapped_input );
+	media_state->mapped_input = 0;
+	
+	avcodec_free_context ( &media_state->audio_codec_ctx );
+	avcodec_free_context ( &media_state->video_codec_ctx );
+	av_packet_free       ( &media_state->audio_packet );
+	av_frame_free        ( &media_state->audio_frame );
+	av_buffer_unref      ( &media_state->audio_boundary );
+	
+	packet_queue_destroy ( &media_state->audio_queue );
+	packet_queue_destroy ( &media_state->video_queue );
+	pcm_ring_destroy     ( &media_state->audio_ring );
+	
+	swr_free ( &media_state->audio_resampler.swr_ctx );
+	if ( media_state->audio_resampler.resampled_data )
 	{
-		media_state->texture = SDL_CreateTexture( media_state->renderer,
-												 SDL_PIXELFORMAT_YV12,
-												 SDL_TEXTUREACCESS_STREAMING,
-												 media_state->video_codec_ctx->width,
-												 media_state->video_codec_ctx->height );
+		av_freep ( &media_state->audio_resampler.resampled_data [ 0 ] );
 	}
+	av_freep ( &media_state->audio_resampler.resampled_data );
 	
-	video_picture_t *video_picture = &media_state->picture_queue [ media_state->picture_queue_read_index ];
+	sliced_scaler_free ( &media_state->video_scaler );
 	
-	F32 aspect_ratio;
-	S32 w, h, x, y;
+	for ( S32 i = 0; i < media_state->picture_queue_capacity; i++ )
+	{
+		av_frame_free ( &media_state->picture_queue [ i ].frame );
+	}
 	
-	if ( video_picture->frame )
+	av_freep ( &media_state->picture_queue );
+	av_buffer_pool_uninit ( &media_state->picture_pool.pool );
+	av_buffer_pool_uninit ( &media_state->decoder_pool.pool );
+	SDL_DestroyMutex ( media_state->decoder_pool.mutex );
+	media_state->decoder_pool.mutex = 0;
+	
+	for ( S32 i = 0; i < TEXTURE_RING_SIZE; i++ )
 	{
-		if ( media_state->video_codec_ctx->sample_aspect_ratio.num == 0 )
-		{
-			aspect_ratio = 0;
-		}
-		else
-		{
-			aspect_ratio = av_q2d ( media_state->video_codec_ctx->sample_aspect_ratio ) * media_state->video_codec_ctx->width / media_state->video_codec_ctx->height;
-		}
-		
-		if ( aspect_ratio <= 0.0 )
+		if ( media_state->textures [ i ] )
 		{
-			aspect_ratio = ( F32 ) media_state->video_codec_ctx->width / ( F32 ) media_state->video_codec_ctx->height;
+			SDL_DestroyTexture ( media_state->textures [ i ] );
+			media_state->textures [ i ] = 0;
 		}
-		
-		S32 screen_width;
-		S32 screen_height;
-		SDL_GetWindowSize ( screen, &screen_width, &screen_height );
-		
-		h = screen_height;
-		
-		w = ( ( S32 ) rint ( h * aspect_ratio ) ) & -3;
-		
-		if ( w > screen_width )
-		{
-			w = screen_width;
-			h = ( ( S32 ) rint ( w / aspect_ratio ) ) & -3;
-		}
-		
-		x = ( screen_width  - w );
-		y = ( screen_height - h );
-		
-		printf ( "Frame %c (%d) pts %lld dts %lld key_frame %d [coded_picture_number %d, display_picture_number %d, %dx%d]\n",
-				av_get_picture_type_char ( video_picture->frame->pict_type ),
-				media_state->video_codec_ctx->frame_number,
-				video_picture->frame->pts,
-				video_picture->frame->pkt_dts,
-				video_picture->frame->key_frame,
-				video_picture->frame->coded_picture_number,
-				video_picture->frame->display_picture_number,
-				video_picture->frame->width,
-				video_picture->frame->height );
-		
-		SDL_Rect rect = { 0 };
-		rect.x        = x;
-		rect.y        = y;
-		rect.w        = 2 * w;
-		rect.h        = 2 * h;
-		
-		SDL_LockMutex ( screen_mutex );
-		
-		SDL_UpdateYUVTexture ( media_state->texture,
-							  &rect,
-							  video_picture->frame->data     [ 0 ],
-							  video_picture->frame->linesize [ 0 ],
-							  video_picture->frame->data     [ 1 ],
-							  video_picture->frame->linesize [ 1 ],
-							  video_picture->frame->data     [ 2 ],
-							  video_picture->frame->linesize [ 2 ] );
-		
-		SDL_RenderClear ( media_state->renderer );
-		
-		SDL_RenderCopy ( media_state->renderer, media_state->texture, 0, 0 );
-		
-		SDL_RenderPresent ( media_state->renderer );
-		
-		SDL_UnlockMutex ( screen_mutex );
 	}
-	else
+	
+	if ( media_state->renderer )
 	{
-		SDL_Event event;
-		event.type       = FF_QUIT_EVENT;
-		event.user.data1 = media_state;
-		SDL_PushEvent ( &event );
+		SDL_DestroyRenderer ( media_state->renderer );
+		media_state->renderer = 0;
+	}
+	
+	if ( media_state->screen )
+	{
+		SDL_DestroyWindow ( media_state->screen );
+		media_state->screen            = 0;
+		media_state->converted_surface = 0;
 	}
+	
+	SDL_DestroyMutex ( media_state->screen_mutex );
+	SDL_DestroyCond  ( media_state->picture_queue_condition );
+	SDL_DestroyMutex ( media_state->picture_queue_mutex );
+	wait_point_destroy ( &media_state->demux_space );
+	
+	media_state->screen_mutex            = 0;
+	media_state->picture_queue_condition = 0;
+	media_state->picture_queue_mutex     = 0;
+	
+	playlist_free ( &media_state->playlist );
 }
 
+static void player_free ( media_state_t *media_state )
+{
+	player_close ( media_state );
+	av_freep ( &media_state->read_cache );
+	av_free ( media_state );
+}
 
-
-void video_refresh_timer ( void *userdata )
+// user events name their player in data1, input and window events go to
+// the player owning the window.
+static media_state_t *player_for_event ( media_state_t **players, S32 num_players, SDL_Event *event )
 {
-    media_state_t   *media_state   = ( media_state_t* ) userdata;
-    video_picture_t *video_picture = 0;
-#ifdef WIN32	
-	HANDLE hc = GetStdHandle ( STD_OUTPUT_HANDLE );
-#endif
+	U32 window_id = 0;
 	
-    F64 pts_delay         = 0;
-    F64 audio_ref_clock   = 0;
-    F64 sync_threshold    = 0;
-    F64 real_delay        = 0;
-    F64 audio_video_delay = 0;
+	if ( event->type >= SDL_USEREVENT )
+	{
+		return event->user.data1;
+	}
 	
+	if ( event->type == SDL_KEYDOWN || event->type == SDL_KEYUP )
+	{
+		window_id = event->key.windowID;
+	}
+	else if ( event->type == SDL_WINDOWEVENT )
+	{
+		window_id = event->window.windowID;
+	}
+	
+	for ( S32 i = 0; i < num_players; i++ )
+	{
+		if ( players [ i ]->screen && SDL_GetWindowID ( players [ i ]->screen ) == window_id )
+		{
+			return players [ i ];
+		}
+	}
 	
-    if ( media_state->video_stream )
+	return num_players == 1 ? players [ 0 ] : 0;
+}
+
+static void handle_event ( media_state_t *media_state, SDL_Event *event )
+{
+    switch ( event->type )
     {
-        if ( media_state->picture_queue_size == 0 )
+        case FF_QUIT_EVENT:
+        case SDL_QUIT:
         {
-            schedule_refresh ( media_state, 1 );
-        }
-        else
-        {
-            video_picture = &media_state->picture_queue [ media_state->picture_queue_read_index ];
-	
-#ifdef WIN32		
-	    SetConsoleTextAttribute  ( hc, 2 );
-#endif
+            player_stop ( media_state );
+        } break;
 		
-			printf ( "Current Frame PTS:      %f\n",   video_picture->pts        );
-            printf ( "Last Frame    PTS:      %f\n", media_state->frame_last_pts );
-			
-            pts_delay = video_picture->pts - media_state->frame_last_pts;
-            printf ( "PTS Delay:              %f\n", pts_delay );
-			
-            if ( pts_delay <= 0 || pts_delay >= 1.0 )
-            {
-                pts_delay = media_state->frame_last_delay;
-            }
-			
-			printf ( "Corrected PTS Delay:    %f\n", pts_delay );
-			
-            media_state->frame_last_delay = pts_delay;
-            media_state->frame_last_pts   = video_picture->pts;
-			
-            audio_ref_clock = get_audio_clock ( media_state );
-			
-            printf ( "Audio Ref Clock:        %f\n", audio_ref_clock );
-			
-            audio_video_delay = video_picture->pts - audio_ref_clock;
-			
-            printf ( "Audio Video Delay:      %f\n", audio_video_delay );
-			
-            sync_threshold = ( pts_delay > AV_SYNC_THRESHOLD) ? pts_delay : AV_SYNC_THRESHOLD;
-			
-            printf ( "Sync Threshold:         %f\n", sync_threshold );
-			
-            if ( fabs ( audio_video_delay ) < AV_NOSYNC_THRESHOLD )
-            {
-                if ( audio_video_delay <= -sync_threshold )
-                {
-                    pts_delay = 0;
-                }
-                else if ( audio_video_delay >= sync_threshold )
-                {
-                    pts_delay = 2 * pts_delay;
-                }
-            }
-			
-            printf ( "Corrected PTS delay:    %f\n", pts_delay );
-			
-            media_state->frame_timer += pts_delay;
-			
-            real_delay = media_state->frame_timer - ( av_gettime ( ) / 1000000.0 );
-			
-            printf ( "Real Delay:             %f\n", real_delay );
-			
-            if ( real_delay < 0.010 )
-            {
-                real_delay = 0.010;
-            }
-			
-            printf ( "Corrected Real Delay:   %f\n", real_delay );
-			
-            schedule_refresh ( media_state, ( S32 ) ( real_delay * 1000 + 0.5 ) );
-			
-            printf("Next Scheduled Refresh: %f\n\n", ( F64 ) ( real_delay * 1000 + 0.5 ) );
-			
-            video_display ( media_state );
-			
-            if ( ++media_state->picture_queue_read_index == VIDEO_PICTURE_QUEUE_SIZE )
+        case SDL_WINDOWEVENT:
+        {
+            if ( event->window.event == SDL_WINDOWEVENT_CLOSE )
             {
-                media_state->picture_queue_read_index = 0 ;
+                player_stop ( media_state );
             }
-#ifdef WIN32			
-			SetConsoleTextAttribute  ( hc, 7 );
-#endif		
-            SDL_LockMutex ( media_state->picture_queue_mutex );
-			
-            media_state->picture_queue_size--;
-            SDL_CondSignal ( media_state->picture_queue_condition );
-            
-			SDL_UnlockMutex ( media_state->picture_queue_mutex );
-        }
-    }
-    else
-    {
-        schedule_refresh ( media_state, 100 );
+        } break;
+		
+        case FF_REFRESH_EVENT:
+        {
+            // only wakes the loop; presenter_update runs after every batch of events.
+        } break;
+		
+        case FF_VIDEO_OPEN_EVENT:
+        {
+            video_open ( event->user.data1 );
+        } break;
+		
+		case SDL_KEYDOWN:
+		{
+			switch( event->key.keysym.sym )
+			{
+				case SDLK_p:
+				{
+				} break;
+				
+				case SDLK_LEFT:
+				{
+					stream_seek ( media_state, get_master_clock ( media_state ), -SEEK_SHORT_STEP );
+				} break;
+				
+				case SDLK_RIGHT:
+				{
+					stream_seek ( media_state, get_master_clock ( media_state ), SEEK_SHORT_STEP );
+				} break;
+				
+				case SDLK_DOWN:
+				{
+					stream_seek ( media_state, get_master_clock ( media_state ), -SEEK_LONG_STEP );
+				} break;
+				
+				case SDLK_UP:
+				{
+					stream_seek ( media_state, get_master_clock ( media_state ), SEEK_LONG_STEP );
+				} break;
+				
+				case SDLK_ESCAPE:
+				{
+					player_stop ( media_state );
+				} break;
+				
+				
+				default:
+				{
+				} break;
+			}
+		} break;
+		
+        default:
+        {
+        } break;
     }
 }
 
-
-
-
-static int audio_resample ( media_state_t *media_state, 
-						   AVFrame *decoded_audio_frame,
-						   enum AVSampleFormat out_sample_fmt,
-						   U8*out_buffer )
+static void print_stage ( const char *name, stage_timer_t *timer )
 {
-	S32 ret = -1;
-	
-	audio_resampling_state_t *ars = get_audio_resampling ( media_state->audio_codec_ctx->channel_layout );
-	
-	if ( !ars->swr_ctx )
+	if ( timer->count == 0 )
 	{
-		fprintf ( stderr, "swr_alloc error\n" );
-		return -1;
+		return;
 	}
 	
-	ars->in_channel_layout = ( media_state->audio_codec_ctx->channels == av_get_channel_layout_nb_channels ( media_state->audio_codec_ctx->channel_layout ) ) ? 
-		media_state->audio_codec_ctx->channel_layout :
-	av_get_default_channel_layout ( media_state->audio_codec_ctx->channels );
-	
-	if ( ars->in_channel_layout <= 0 )
+	printf ( "  %-16s %8llu %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+			name,
+			timer->count,
+			timer->total / 1e6 / timer->count,
+			stage_timer_percentile ( timer, 50 ),
+			stage_timer_percentile ( timer, 90 ),
+			stage_timer_percentile ( timer, 99 ),
+			timer->max / 1e6 );
+}
+
+static void print_occupancy ( const char *name, occupancy_t *occupancy, const char *unit )
+{
+	if ( occupancy->samples == 0 )
 	{
-		fprintf ( stderr, "in_channel_layout error\n" );
-		return -1;
+		return;
 	}
 	
-    if ( media_state->audio_codec_ctx->channels == 1 )
-    {
-        ars->out_channel_layout = AV_CH_LAYOUT_MONO;
-    }
-    else if ( media_state->audio_codec_ctx->channels == 2 )
-    {
-        ars->out_channel_layout = AV_CH_LAYOUT_STEREO;
-    }
-    else
-    {
-        ars->out_channel_layout = AV_CH_LAYOUT_SURROUND;
-    }
+	printf ( "  %-16s %9.1f %9d %s\n", name, occupancy->total / occupancy->samples, occupancy->max, unit );
+}
+
+void print_bench_report ( media_state_t *media_state, F64 seconds )
+{
+	pipeline_stats_t *stats = &media_state->stats;
 	
-    ars->in_num_samples = decoded_audio_frame->nb_samples;
-    if ( ars->in_num_samples <= 0 )
-    {
-        printf ( "in_num_samples error\n");
-        return -1;
-    }
+	printf ( "\nBenchmark: %s\n", media_state->filename );
+	printf ( "  wall time        %9.3f s\n", seconds );
+	printf ( "  video frames     %9d (%.1f fps)\n", stats->video_frames, seconds > 0 ? stats->video_frames / seconds : 0.0 );
+	printf ( "  audio frames     %9d (%.1f fps)\n", stats->audio_frames, seconds > 0 ? stats->audio_frames / seconds : 0.0 );
+	printf ( "\n  %-16s %8s %9s %9s %9s %9s %9s\n", "stage (ms)", "count", "mean", "p50", "p90", "p99", "max" );
+	
+	print_stage ( "demux",          &stats->demux          );
+	print_stage ( "video decode",   &stats->video_decode   );
+	print_stage ( "video convert",  &stats->video_convert  );
+	print_stage ( "audio decode",   &stats->audio_decode   );
+	print_stage ( "audio resample", &stats->audio_resample );
 	
-	av_opt_set_int ( ars->swr_ctx,
-					"in_channel_layout",
-					ars->in_channel_layout,
-					0 );
+	printf ( "\n  %-16s %9s %9s\n", "queue", "mean", "max" );
 	
-	av_opt_set_int ( ars->swr_ctx,
-					"in_sample_rate",
-					media_state->audio_codec_ctx->sample_rate,
-					0 );
+	print_occupancy ( "video packets", &stats->video_packets, "packets"  );
+	print_occupancy ( "audio packets", &stats->audio_packets, "packets"  );
+	print_occupancy ( "pictures",      &stats->pictures,      "pictures" );
+	
+	printf ( "\n  peak RSS         %9.1f MB\n", peak_rss_megabytes ( ) );
+	
+	if ( media_state->read_cache )
+	{
+		printf ( "\n" );
+		read_cache_print_stats ( media_state->read_cache );
+	}
+}
+
+// null presenter: takes pictures off the queue as soon as they are ready.
+void bench_run ( media_state_t *media_state )
+{
+	U64 start = SDL_GetPerformanceCounter ( );
+	
+	for ( ; ; )
+	{
+		SDL_Event event;
+		
+		if ( SDL_PollEvent ( &event ) && event.type == FF_QUIT_EVENT )
+		{
+			break;
+		}
+		
+		SDL_LockMutex ( media_state->picture_queue_mutex );
+		
+		if ( media_state->picture_queue_size == 0 )
+		{
+			SDL_CondWaitTimeout ( media_state->picture_queue_condition, media_state->picture_queue_mutex, 10 );
+		}
+		
+		S32 queued = media_state->picture_queue_size;
+		
+		SDL_UnlockMutex ( media_state->picture_queue_mutex );
+		
+		if ( queued == 0 )
+		{
+			bool32 video_done = !media_state->video_stream || SDL_AtomicGet ( &media_state->video_finished );
+			bool32 audio_done = !media_state->audio_stream || SDL_AtomicGet ( &media_state->audio_ring.finished );
+			
+			if ( ( media_state->video_stream || media_state->audio_stream ) && video_done && audio_done )
+			{
+				break;
+			}
+			
+			continue;
+		}
+		
+		occupancy_sample ( &media_state->stats.video_packets, packet_queue_count ( &media_state->video_queue ) );
+		occupancy_sample ( &media_state->stats.audio_packets, packet_queue_count ( &media_state->audio_queue ) );
+		occupancy_sample ( &media_state->stats.pictures,      queued );
+		
+		media_state->stats.video_frames++;
+		
+		av_frame_unref ( media_state->picture_queue [ media_state->picture_queue_read_index ].frame );
+		
+		if ( ++media_state->picture_queue_read_index == media_state->picture_queue_capacity )
+		{
+			media_state->picture_queue_read_index = 0;
+		}
+		
+		SDL_LockMutex   ( media_state->picture_queue_mutex );
+		media_state->picture_queue_size--;
+		SDL_CondSignal  ( media_state->picture_queue_condition );
+		SDL_UnlockMutex ( media_state->picture_queue_mutex );
+	}
 	
+	F64 seconds = ( F64 ) ( SDL_GetPerformanceCounter ( ) - start ) / SDL_GetPerformanceFrequency ( );
 	
-    av_opt_set_sample_fmt(
-						  ars->swr_ctx,
-						  "in_sample_fmt",
-						  media_state->audio_codec_ctx->sample_fmt,
-						  0
-						  );
-	//=========================================================================
+	media_state->quit = true;
+	packet_queue_abort ( &media_state->audio_queue );
+	packet_queue_abort ( &media_state->video_queue );
 	
-	av_opt_set_int ( ars->swr_ctx,
-					"out_channel_layout",
-					ars->out_channel_layout,
-					0 );
+	SDL_LockMutex     ( media_state->picture_queue_mutex );
+	SDL_CondBroadcast ( media_state->picture_queue_condition );
+	SDL_UnlockMutex   ( media_state->picture_queue_mutex );
 	
-	av_opt_set_int ( ars->swr_ctx,
-					"out_sample_rate",
-					media_state->audio_codec_ctx->sample_rate,
-					0 );
+	print_bench_report ( media_state, seconds );
+}
+
+
+// counting starts once every player has been playing for ALLOC_STATS_WARMUP
+// seconds, so opening inputs, codecs, windows and pools is not reported.
+// It stops as soon as any player quits, before its teardown.
+static void alloc_stats_update ( media_state_t **players, S32 num_players )
+{
+	if ( alloc_stats.stop > 0 )
+	{
+		return;
+	}
 	
-	av_opt_set_sample_fmt ( ars->swr_ctx,
-						   "out_sample_fmt",
-						   out_sample_fmt,
-						   0 );
+	F64 playing = 0;
 	
-	ret = swr_init ( ars->swr_ctx );
-	if ( ret < 0 )
+	for ( S32 i = 0; i < num_players; i++ )
 	{
-		fprintf ( stderr, "Failed to initialize the resampling context\n" );
-		return -1;
+		if ( players [ i ]->quit )
+		{
+			alloc_stats.counting = false;
+			alloc_stats.stop     = presenter_now ( );
+			return;
+		}
+		
+		F64 first = FFMAX ( players [ i ]->startup.first_frame, players [ i ]->startup.first_audio );
+		if ( first <= 0 )
+		{
+			return;
+		}
+		
+		playing = FFMAX ( playing, first );
 	}
 	
-	ars->max_out_num_samples = ars->out_num_samples = av_rescale_rnd ( ars->in_num_samples,
-																	  media_state->audio_codec_ctx->sample_rate,
-																	  media_state->audio_codec_ctx->sample_rate,
-																	  AV_ROUND_UP );
-	if ( ars->max_out_num_samples <= 0 )
+	if ( !alloc_stats.counting && presenter_now ( ) - playing >= ALLOC_STATS_WARMUP )
 	{
-		fprintf ( stderr, "av_rescale_rnd error\n" );
-		return -1;
+		alloc_stats.start    = presenter_now ( );
+		alloc_stats.counting = true;
 	}
+}
+
+static int alloc_site_compare ( const void *a, const void *b )
+{
+	S32 count_a = SDL_AtomicGet ( &( *( alloc_site_t** ) a )->count );
+	S32 count_b = SDL_AtomicGet ( &( *( alloc_site_t** ) b )->count );
 	
-	ars->out_num_channels = av_get_channel_layout_nb_channels ( ars->out_channel_layout );
-	
-	ret = av_samples_alloc_array_and_samples ( &ars->resampled_data,
-											  &ars->out_linesize,
-											  ars->out_num_channels,
-											  ars->out_num_samples,
-											  out_sample_fmt,
-											  0 );
-	
-	if ( ret < 0 )
+	return ( count_a < count_b ) - ( count_a > count_b );
+}
+
+static void alloc_stats_report ( void )
+{
+	if ( alloc_stats.counting )
 	{
-		fprintf ( stderr, "av_samples_alloc_array_and_samples() error: Could not allocate destination samples\n" );
-		return -1;
+		alloc_stats.counting = false;
+		alloc_stats.stop     = presenter_now ( );
 	}
 	
-	ars->out_num_samples = av_rescale_rnd ( swr_get_delay ( ars->swr_ctx, media_state->audio_codec_ctx->sample_rate ) + ars->in_num_samples,
-										   media_state->audio_codec_ctx->sample_rate,
-										   media_state->audio_codec_ctx->sample_rate,
-										   AV_ROUND_UP );
+	printf ( "\nAllocations after warm-up:\n" );
 	
-	if ( ars->out_num_samples <= 0 )
+	if ( alloc_stats.start <= 0 )
 	{
-		fprintf ( stderr, "av_rescale_rnd error\n" );
-		return -1;
+		printf ( "  playback ended before the %.0f s warm-up\n", ALLOC_STATS_WARMUP );
+		return;
 	}
 	
-	if ( ars->out_num_samples > ars->max_out_num_samples )
-	{
-		av_free ( ars->resampled_data [ 0 ] );
-		
-		ret = av_samples_alloc ( ars->resampled_data,
-								&ars->out_linesize,
-								ars->out_num_channels,
-								ars->out_num_samples,
-								out_sample_fmt,
-								1 );
-		
-		if ( ret < 0 )
-		{
-			fprintf ( stderr, "av_samples_alloc failed!\n" );
-			return -1;
-		}
-		
-		ars->max_out_num_samples = ars->out_num_samples;
-	}
+	static alloc_site_t *sorted [ ALLOC_SITE_SLOTS ];
+	S32 num_sites = 0;
+	S64 total     = 0;
+	F64 seconds   = FFMAX ( alloc_stats.stop - alloc_stats.start, 1e-3 );
 	
-	if ( ars->swr_ctx )
+	for ( S32 i = 0; i < ALLOC_SITE_SLOTS; i++ )
 	{
-		ret = swr_convert ( ars->swr_ctx,
-						   ars->resampled_data,
-						   ars->out_num_samples,
-						   ( const U8** ) decoded_audio_frame->data,
-						   decoded_audio_frame->nb_samples );
-		
-		if ( ret < 0 )
-		{
-			fprintf ( stderr, "swr_convert_error\n" );
-			return -1;
-		}
-		
-		ars->resampled_data_size = av_samples_get_buffer_size ( &ars->out_linesize,
-															   ars->out_num_channels,
-															   ret,
-															   out_sample_fmt,
-															   1 );
-		
-		if ( ars->resampled_data_size < 0 )
+		if ( SDL_AtomicGet ( &alloc_stats.sites [ i ].state ) == 2 )
 		{
-			fprintf ( stderr, "av_samples_get_buffer_size error\n" );
-			return -1;
+			sorted [ num_sites++ ] = &alloc_stats.sites [ i ];
+			total += SDL_AtomicGet ( &alloc_stats.sites [ i ].count );
 		}
 	}
-	else
-	{
-		fprintf ( stderr, "swr_ctx null error\n" );
-		return -1;
-	}
 	
-	memcpy ( out_buffer, ars->resampled_data [ 0 ], ars->resampled_data_size );
+	total += SDL_AtomicGet ( &alloc_stats.lost );
 	
-	if ( ars->resampled_data )
+	printf ( "  %lld allocations in %.1f s (%.1f/s) from %d call sites\n", total, seconds, total / seconds, num_sites );
+	
+	if ( SDL_AtomicGet ( &alloc_stats.lost ) > 0 )
 	{
-		av_freep ( &ars->resampled_data [ 0 ] );
+		printf ( "  %d allocations did not fit the site table\n", SDL_AtomicGet ( &alloc_stats.lost ) );
 	}
 	
-	av_freep ( &ars->resampled_data );
-	ars->resampled_data = 0;
+	qsort ( sorted, num_sites, sizeof ( alloc_site_t* ), alloc_site_compare );
 	
-	if ( ars->swr_ctx )
+	for ( S32 i = 0; i < FFMIN ( num_sites, ALLOC_STATS_TOP_SITES ); i++ )
 	{
-		swr_free ( &ars->swr_ctx );
+		S32 count = SDL_AtomicGet ( &sorted [ i ]->count );
+		
+		printf ( "\n  %9d (%.1f/s):\n", count, count / seconds );
+		alloc_stats_print_site ( sorted [ i ] );
 	}
-	
-	return ars->resampled_data_size;
 }
 
 
-int audio_decode_frame ( media_state_t *media_state, 
-						U8             *audio_buffer, 
-						S32             buffer_size,
-						F64            *pts_ptr )
+// one independent player: its own inputs, threads, window and audio device.
+// Players share the worker pool and are presented by the main loop.
+static media_state_t *player_open ( player_options_t *options, worker_pool_t *workers, const char **inputs, S32 num_inputs, F64 launched )
 {
-	AVPacket *packet = av_packet_alloc ( );
+	media_state_t *media_state = av_mallocz ( sizeof ( media_state_t ) );
+	assert ( media_state );
 	
-	static U8 *audio_packet_data = 0;
-	static S32 audio_packet_size = 0;
+	media_state->options          = *options;
+	media_state->workers          = workers;
+	media_state->startup.launched = launched;
 	
-	static AVFrame *frame = 0;
-	frame = av_frame_alloc ( );
-	if  ( !frame )
+	if ( playlist_load ( &media_state->playlist, inputs, num_inputs ) < 0 )
 	{
-		fprintf ( stderr, "Could not allocate AVFrame\n" );
-		return -1;
+		playlist_free ( &media_state->playlist );
+		av_free ( media_state );
+		return 0;
 	}
 	
-	S32 len       = 0;
-	S32 data_size = 0;
+	media_state->playlist.loop = options->loop;
+	av_strlcpy ( media_state->filename, media_state->playlist.items [ 0 ], sizeof ( media_state->filename ) );
 	
-	F64 pts       = 0;
-	S32 channels  = 0;
 	
-	for ( ; ; )
+	media_state->picture_queue_mutex     = SDL_CreateMutex ( );
+	media_state->picture_queue_condition = SDL_CreateCond  ( );
+	media_state->picture_queue_capacity  = options->picture_queue_size;
+	media_state->texture_shown           = -1;
+	media_state->picture_pool.huge_pages = options->huge_pages;
+	media_state->decoder_pool.huge_pages = options->huge_pages;
+	media_state->decoder_pool.mutex      = options->huge_pages ? SDL_CreateMutex ( ) : 0;
+	media_state->picture_queue           = av_mallocz ( media_state->picture_queue_capacity * sizeof ( video_picture_t ) );
+	assert ( media_state->picture_queue );
+	
+	for ( S32 i = 0; i < media_state->picture_queue_capacity; i++ )
 	{
-		if ( media_state->quit )
-		{
-			return -1;
-		}
-		
-		while ( audio_packet_size > 0 )
-		{
-			bool32 got_frame = false;
-			
-			int ret = avcodec_receive_frame ( media_state->audio_codec_ctx, frame );
-			if ( ret == 0 )
-			{
-				got_frame = true;
-			}
-			if ( ret == AVERROR ( EAGAIN ) )
-			{
-				ret = 0;
-			}
-			if ( ret == 0 )
-			{
-				ret = avcodec_send_packet ( media_state->audio_codec_ctx, packet );
-			}
-			if ( ret == AVERROR ( EAGAIN ) )
-			{
-				ret = 0;
-			}
-			else if ( ret < 0 )
-			{
-				fprintf ( stderr, "avcodec_receive_frame error" );
-				return -1;
-			}
-			else
-			{
-				len = packet->size;
-			}
-			
-			if ( len < 0 )
-			{
-				audio_packet_size = 0;
-				break;
-			}
-			
-			audio_packet_data += len;
-			audio_packet_size -= len;
-			data_size          = 0;
-			
-			if ( got_frame )
-			{
-				data_size = audio_resample ( media_state,
-											frame,
-											AV_SAMPLE_FMT_S16,
-											audio_buffer );
-				
-                assert ( data_size <= buffer_size );
-            }
-			
-            if ( data_size <= 0 )
-            {
-                continue;
-            }
-			
-			pts                      = media_state->audio_clock;
-            *pts_ptr                 = pts;
-			channels                 = 2 * media_state->audio_codec_ctx->channels;
-            media_state->audio_clock += ( F64 ) data_size / ( F64 )( channels * media_state->audio_codec_ctx->sample_rate );
-			
-            return data_size;
-        }
-		
-        if ( packet->data )
-        {
-            av_packet_unref ( packet );
-        }
-		
-        int ret = packet_queue_get ( &media_state->audio_queue, packet, 1 );
-		
-        if ( ret < 0 )
-        {
-            return -1;
-        }
-		
-        audio_packet_data = packet->data;
-        audio_packet_size = packet->size;
-		
-        if ( packet->pts != AV_NOPTS_VALUE )
-        {
-            media_state->audio_clock = av_q2d ( media_state->audio_stream->time_base ) * packet->pts;
-        }
+		media_state->picture_queue [ i ].frame = av_frame_alloc ( );
+		assert ( media_state->picture_queue [ i ].frame );
+	}
+	
+	wait_point_init ( &media_state->demux_space );
+	
+	
+    media_state->decode_thread_id = SDL_CreateThread ( decode_thread, "Decoding Thread", media_state );
+    if ( !media_state->decode_thread_id )
+    {
+        fprintf ( stderr, "Could not start decoding SDL_Thread - exiting\n" );
+        player_free ( media_state );
+        return 0;
     }
 	
-    return 0;
+	if ( options->fast_start && !options->bench )
+	{
+		video_open_window ( media_state, FAST_START_WINDOW_WIDTH, FAST_START_WINDOW_HEIGHT );
+	}
+	
+	return media_state;
 }
 
 
@@ -1441,13 +6947,20 @@ int main ( int argc, char **argv )
 	SDL_SetMainReady();
 	int ret = -1;
 	
+	F64 launched = presenter_now ( );
+	
 	
 #ifdef WIN32
 	HANDLE hc = GetStdHandle ( STD_OUTPUT_HANDLE );
 	SetEnvironmentVariableA ( "SDL_AUDIODRIVER", "directsound" );
 #endif
 	
-	if ( !( argc == 2 ) )
+	player_options_t options = { 0 };
+	options.audio_ring_ms      = DEFAULT_AUDIO_RING_MS;
+	options.picture_queue_size = DEFAULT_PICTURE_QUEUE_SIZE;
+	options.log_level          = LOG_INFO;
+	
+	if ( !parse_options ( &options, argc, argv ) )
     {
 		
 #ifdef WIN32
@@ -1458,7 +6971,29 @@ printf  ( "\n5433D R32433 <saeed@rezaee.net>\n" );
 #ifdef WIN32
 	SetConsoleTextAttribute  ( hc, 6 );
 #endif
-	fprintf ( stderr, "Usage: %s video_file_path\n", argv [ 0 ] );	
+	fprintf ( stderr, "Usage: %s [options] video_file_path...\n", argv [ 0 ] );	
+	fprintf ( stderr, "  several files, .m3u/.m3u8 lists and ffconcat scripts play back to back without gaps\n" );
+	fprintf ( stderr, "  --audio-ring <ms>    decoded audio buffered ahead of the device (default %d)\n", DEFAULT_AUDIO_RING_MS );
+	fprintf ( stderr, "  --pictures <n>       decoded pictures queued ahead of display, 1-%d (default %d)\n", MAX_PICTURE_QUEUE_SIZE, DEFAULT_PICTURE_QUEUE_SIZE );
+	fprintf ( stderr, "  --threads <n|auto>   video decoder threads (default auto)\n" );
+	fprintf ( stderr, "  --thread-type <t>    frame, slice, both or auto (default auto)\n" );
+	fprintf ( stderr, "  --bench              decode as fast as possible without window or audio device, then report\n" );
+	fprintf ( stderr, "  --no-audio           ignore the audio stream\n" );
+	fprintf ( stderr, "  --accurate-seek      after a seek, decode up to the exact target instead of the nearest keyframe\n" );
+	fprintf ( stderr, "  --index              write the keyframe index sidecar (<file>.vpidx) and exit\n" );
+	fprintf ( stderr, "  --cache-mb <n>       read through an n MB read-ahead cache (e.g. 64-512 for network or spinning storage)\n" );
+	fprintf ( stderr, "  --mmap               map a local file into memory instead of reading it (overrides --cache-mb)\n" );
+	fprintf ( stderr, "  --log-level <l>      error, warning, info, debug (per frame timing) or trace (default info)\n" );
+	fprintf ( stderr, "  --log-file <path>    write binary log events to a file instead of the console\n" );
+	fprintf ( stderr, "  --decode-log <path>  print a binary log file as text and exit\n" );
+	fprintf ( stderr, "  --trace <path>       write per-frame pipeline spans as chrome trace JSON (open in Perfetto)\n" );
+	fprintf ( stderr, "  --multi              play every input as an independent player, in one process\n" );
+	fprintf ( stderr, "  --loop               start the playlist over after its last item\n" );
+	fprintf ( stderr, "  --huge-pages         back decoded (and --bench converted) pictures with 2 MB pages (Windows needs the lock pages privilege)\n" );
+	fprintf ( stderr, "  --alloc-stats        once playback has warmed up, count heap allocations per call site and report them at exit\n" );
+	fprintf ( stderr, "  --fast-start         small probe limits, no stream info scan for mp4/mkv, parallel codec and window setup\n" );
+	fprintf ( stderr, "  --probesize <bytes>  bytes read to detect the format and streams (fast start default %d)\n", FAST_START_PROBESIZE );
+	fprintf ( stderr, "  --analyzeduration <ms> stream time analysed for stream parameters (fast start default %d)\n", FAST_START_ANALYZE_MS );
 #ifdef WIN32 
 	SetConsoleTextAttribute  ( hc, 7 );
 #endif
@@ -1466,86 +7001,155 @@ printf  ( "\n5433D R32433 <saeed@rezaee.net>\n" );
 		return -1;
     }
 	
-	if ( SDL_Init ( SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER ) ) 
+	if ( options.decode_log )
+	{
+		return log_decode_file ( options.decode_log );
+	}
+	
+	if ( options.build_index )
+	{
+		return keyframe_index_build_file ( options.filename );
+	}
+	
+	if ( log_init ( options.log_level, options.log_file, options.trace_file ) < 0 )
+	{
+		return -1;
+	}
+	
+	log_thread_name ( "main" );
+	
+	if ( options.alloc_stats && !alloc_stats_install ( ) )
+	{
+		return -1;
+	}
+	
+	if ( SDL_Init ( options.bench ? SDL_INIT_TIMER | SDL_INIT_EVENTS : SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER ) ) 
 	{
 		fprintf ( stderr, "Could not initialize SDL - %s\n", SDL_GetError ( ) );
 		exit ( EXIT_FAILURE );
 	}
 	
-	media_state_t *media_state = av_mallocz ( sizeof ( media_state_t ) );
-	assert ( media_state );
-	
-	av_strlcpy ( media_state->filename, argv [ 1 ], sizeof ( media_state->filename ) );
+	static worker_pool_t workers;
 	
+	worker_pool_init ( &workers, SDL_GetCPUCount ( ) - 1 );
 	
-	media_state->picture_queue_mutex     = SDL_CreateMutex ( );
-	media_state->picture_queue_condition = SDL_CreateCond  ( );
+	media_state_t *players [ MAX_PLAYERS ] = { 0 };
+	S32 num_players                        = options.multi ? options.num_inputs : 1;
 	
+	options.num_players = num_players;
 	
-    schedule_refresh ( media_state, 100 );
+	for ( S32 i = 0; i < num_players; i++ )
+	{
+		players [ i ] = options.multi ? player_open ( &options, &workers, options.inputs + i, 1, launched ) :
+		                                player_open ( &options, &workers, options.inputs, options.num_inputs, launched );
+		if ( !players [ i ] )
+		{
+			// the players already running are stopped and torn down first.
+			for ( S32 j = 0; j < i; j++ )
+			{
+				player_stop ( players [ j ] );
+				player_free ( players [ j ] );
+			}
+			
+			log_shutdown ( );
+			SDL_Quit ( );
+			return -1;
+		}
+	}
 	
-    media_state->decode_thread_id = SDL_CreateThread ( decode_thread, "Decoding Thread", media_state );
-    if ( !media_state->decode_thread_id )
+    if ( options.bench )
     {
-        fprintf ( stderr, "Could not start decoding SDL_Thread - exiting\n" );
-        av_free ( media_state );
-        return -1;
+        bench_run   ( players [ 0 ] );
+        player_free ( players [ 0 ] );
+        log_shutdown ( );
+        return 0;
     }
 	
+#ifdef WIN32
+	// 1 ms scheduler ticks, so the presenter's timed waits are not rounded up to 15.6 ms.
+	timeBeginPeriod ( 1 );
+#endif
+	
+	// one loop presents for every player; each is updated after every batch of events.
 	SDL_Event event;
-	for ( ; ; )
+	S32 num_running = num_players;
+	
+	while ( num_running > 0 )
 	{
-		ret = SDL_WaitEvent ( &event );
-		if ( !ret )
+		S32 wait_ms = PRESENT_IDLE_WAIT_MS;
+		
+		for ( S32 i = 0; i < num_players; i++ )
 		{
-			fprintf ( stderr, "SDL_WaitEvent failed: %s\n", SDL_GetError ( ) );
+			if ( !players [ i ]->quit )
+			{
+				wait_ms = FFMIN ( wait_ms, presenter_wait_ms ( players [ i ] ) );
+			}
 		}
 		
-        switch(event.type)
-        {
-            case FF_QUIT_EVENT:
-            case SDL_QUIT:
-            {
-                media_state->quit = true;
-                SDL_Quit ( );
-            } break;
-			
-            case FF_REFRESH_EVENT:
-            {
-                video_refresh_timer ( event.user.data1 );
-            } break;
-			
-			case SDL_KEYDOWN:
+		if ( SDL_WaitEventTimeout ( &event, wait_ms ) )
+		{
+			do
 			{
-				switch( event.key.keysym.sym )
+				for ( S32 i = 0; i < num_players; i++ )
 				{
-					case SDLK_p:
-					{
-					} break;
-					
-					case SDLK_ESCAPE:
-					{
-						media_state->quit = true;
-						SDL_Quit ( );
-					} break;
-					
-					
-					default:
+					if ( !players [ i ]->quit && ( event.type == SDL_QUIT || player_for_event ( players, num_players, &event ) == players [ i ] ) )
 					{
-					} break;
+						handle_event ( players [ i ], &event );
+					}
 				}
-			} break;
+			}
+			while ( SDL_PollEvent ( &event ) );
+		}
+		
+		num_running = 0;
+		
+		for ( S32 i = 0; i < num_players; i++ )
+		{
+			if ( !players [ i ]->quit )
+			{
+				presenter_update ( players [ i ] );
+			}
 			
-            default:
-            {
-            } break;
-        }
+			num_running += !players [ i ]->quit;
+		}
 		
-        if ( media_state->quit )
-        {
-            break;
-        }
+		if ( options.alloc_stats )
+		{
+			alloc_stats_update ( players, num_players );
+		}
+		
+		// a stopped player does not keep its threads, decoders and window while the others play.
+		for ( S32 i = 0; i < num_players; i++ )
+		{
+			if ( players [ i ]->quit )
+			{
+				player_close ( players [ i ] );
+			}
+		}
+	}
+	
+#ifdef WIN32
+	timeEndPeriod ( 1 );
+#endif
+	
+	if ( options.alloc_stats )
+	{
+		alloc_stats_report ( );
+	}
+	
+	for ( S32 i = 0; i < num_players; i++ )
+	{
+		if ( num_players > 1 )
+		{
+			printf ( "\nPlayer %d: %s\n", i + 1, players [ i ]->filename );
+		}
+		
+		print_playback_stats ( players [ i ] );
+		player_free ( players [ i ] );
 	}
 	
+	log_shutdown ( );
+	SDL_Quit ( );
+	
 	return 0;
 }